@@ -28,7 +28,16 @@ POSSIBILITY OF SUCH DAMAGE.
 Authors: Halvdan Hoem Grelland, Magnus Skjegstad
 '''
 
-import socket, struct
+import socket, struct, time
+
+# Wire formats (low byte of version_id). The high byte is the highest format
+# the sender accepts, if that is higher. v1 peers send 1.
+VERSION_V1 = 1
+VERSION_V2 = 2
+VERSION_V3 = 3 # v2, compressed (see Node.pack_v3)
+
+# Default RADAC port, which v2 Node records leave out
+DEFAULT_RADAC_PORT = 45542
 
 class IPCMessage(object):
    
@@ -190,18 +199,32 @@ class NodeCollection(object):
     def __repr__(self):
         return self.__str__()
 
-    def pack(self):
+    def pack(self, now = None):
         """
-        Returns a packed/serialized representation.
+        Returns a packed/serialized representation, in the wire format given
+        by the low byte of version_id. now is the time v2 ages are counted
+        from, the current time if not given.
         """
         p = struct.pack('!HBH', self.version_id, self.payload_type, len(self.nodes))
-        for node in self.nodes:
-            p += node.pack()
+        if self.version_id & 0xff == VERSION_V2:
+            if now is None:
+                now = int(time.time())
+            for node in self.nodes:
+                p += node.pack_v2(now)
+        elif self.version_id & 0xff == VERSION_V3:
+            if now is None:
+                now = int(time.time())
+            ref = Node.v3_reference()
+            for node in self.nodes:
+                p += node.pack_v3(now, ref)
+        else:
+            for node in self.nodes:
+                p += node.pack()
 
         return p
 
     @classmethod
-    def from_bytes(cls, b):
+    def from_bytes(cls, b, now = None):
         """
         Construct object from packed byte array.
         
@@ -213,10 +236,11 @@ class NodeCollection(object):
         +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
         
         We unpack the leading five bytes of the buffer to extract the header.
-        Subsequently we unpack each Node object using the Node.from_bytes() method.
+        Subsequently we unpack each Node object using the Node.from_bytes() method,
+        or Node.from_bytes_v2()/_v3() if the low byte of version_id is VERSION_V2/_V3.
+        Their timestamps are then now (the current time if not given) less their age.
 
-        TODO No real error checking is performed. A malformed result will most
-        likely return None.
+        Returns None if the buffer is too short for its node count.
         """
         offset = 5
         header = struct.unpack('!HBH',b[:offset])   # Bytes 0->5
@@ -225,9 +249,25 @@ class NodeCollection(object):
         node_count = header[2]
 
         nodes = []
-        for i in range(node_count):
-            nodes.append(Node.from_bytes(b[ offset : offset + Node.PACKED_SIZE ]))
-            offset += Node.PACKED_SIZE
+        if version_id & 0xff in (VERSION_V2, VERSION_V3):
+            if now is None:
+                now = int(time.time())
+            ref = Node.v3_reference()
+            for i in range(node_count):
+                if version_id & 0xff == VERSION_V3:
+                    node, size = Node.from_bytes_v3(b[offset:], now, ref)
+                else:
+                    node, size = Node.from_bytes_v2(b[offset:], now)
+                if node is None:
+                    return None
+                nodes.append(node)
+                offset += size
+        else:
+            for i in range(node_count):
+                if offset + Node.PACKED_SIZE > len(b):
+                    return None
+                nodes.append(Node.from_bytes(b[ offset : offset + Node.PACKED_SIZE ]))
+                offset += Node.PACKED_SIZE
 
         # Integrity check
         if len(nodes) != node_count:
@@ -238,15 +278,22 @@ class NodeCollection(object):
 
 class Node(object):
 
-    def __init__(self, node_id, lat, lon, coord_range, ip, port, radac_ip, radac_port, timestamp):
+    def __init__(self, node_id, lat, lon, coord_range, ip, port, radac_ip, radac_port, timestamp, accepts = VERSION_V1):
         self.node_id = node_id
         self.position = (lat, lon)
         self.coord_range = coord_range
         self.address = (ip, port)
         self.radac_address = (radac_ip, radac_port)
         self.timestamp = timestamp
+        self.accepts = accepts # Highest wire format the node accepts
 
     PACKED_SIZE = 38 #4 + 8 + 8 + 2 + 4 + 2 + 4 + 2 + 4 bytes
+
+    # Flags of a v2 record
+    V2_RADAC_IP = 0x01      # radac ip follows, else it is the node ip
+    V2_RADAC_PORT = 0x02    # radac port follows, else it is DEFAULT_RADAC_PORT
+    V2_ACCEPTS_V2 = 0x04    # the node accepts v2 packets
+    V2_ACCEPTS_V3 = 0x08    # the node accepts v3 packets
     
     def __str__(self):
         sb = ['\n  Node :']
@@ -284,6 +331,168 @@ class Node(object):
     def pack(self):
         return struct.pack('!IddHIHIHI', *self._packable())
 
+    def pack_v2(self, now):
+        """
+        Returns the v2 record of the Node. Its layout is as follows:
+        +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+        | node_id | lat | lon | coord_range | ip | port | flags | ...   |
+        +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+        | 4       | 4   | 4   | 2           | 4  | 2    | 1     |       |
+        +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+        followed by radac ip (4) and radac port (2) if flagged, and the age
+        (now - timestamp) in seconds as an unsigned LEB128 varint. lat and lon
+        are signed micro-degrees.
+        """
+        ip = _ip2int(self.address[0])
+        radac_ip = _ip2int(self.radac_address[0])
+        flags = 0
+        if radac_ip != ip:
+            flags |= self.V2_RADAC_IP
+        if self.radac_address[1] != DEFAULT_RADAC_PORT:
+            flags |= self.V2_RADAC_PORT
+        flags |= self._accepts_flags()
+
+        lat, lon = self._fixed_position()
+        p = struct.pack('!IiiHIHB', self.node_id, lat, lon, self.coord_range, ip, self.address[1], flags)
+        if flags & self.V2_RADAC_IP:
+            p += struct.pack('!I', radac_ip)
+        if flags & self.V2_RADAC_PORT:
+            p += struct.pack('!H', self.radac_address[1])
+        return p + _pack_varint(max(0, now - self.timestamp))
+
+    V2_FIXED_SIZE = 21 # Up to and including flags
+
+    @classmethod
+    def from_bytes_v2(cls, b, now):
+        """
+        Construct a Node from the v2 record at the start of b, see pack_v2.
+        Returns the Node and the size of the record, or (None, 0) if b is too short.
+        """
+        if len(b) < cls.V2_FIXED_SIZE:
+            return None, 0
+        node_id, lat, lon, coord_range, ip, port, flags = struct.unpack('!IiiHIHB', b[:cls.V2_FIXED_SIZE])
+        offset = cls.V2_FIXED_SIZE
+        radac_ip, radac_port = ip, DEFAULT_RADAC_PORT
+        if flags & cls.V2_RADAC_IP:
+            if len(b) < offset + 4:
+                return None, 0
+            radac_ip = struct.unpack('!I', b[offset:offset + 4])[0]
+            offset += 4
+        if flags & cls.V2_RADAC_PORT:
+            if len(b) < offset + 2:
+                return None, 0
+            radac_port = struct.unpack('!H', b[offset:offset + 2])[0]
+            offset += 2
+        age, size = _unpack_varint(b[offset:])
+        if size == 0:
+            return None, 0
+
+        node = cls(node_id, lat / 1000000.0, lon / 1000000.0, coord_range,
+                   _int2ip(ip), port, _int2ip(radac_ip), radac_port,
+                   max(0, now - age), cls._accepts_from_flags(flags))
+        return node, offset + size
+
+    def _accepts_flags(self):
+        flags = 0
+        if self.accepts >= VERSION_V2:
+            flags |= self.V2_ACCEPTS_V2
+        if self.accepts >= VERSION_V3:
+            flags |= self.V2_ACCEPTS_V3
+        return flags
+
+    @classmethod
+    def _accepts_from_flags(cls, flags):
+        if flags & cls.V2_ACCEPTS_V3:
+            return VERSION_V3
+        if flags & cls.V2_ACCEPTS_V2:
+            return VERSION_V2
+        return VERSION_V1
+
+    def _fixed_position(self):
+        """lat, lon in micro-degrees"""
+        return (int(round(max(-90.0, min(90.0, self.position[0])) * 1000000)),
+                int(round(max(-180.0, min(180.0, self.position[1])) * 1000000)))
+
+    @staticmethod
+    def v3_reference():
+        """What the first v3 record of a packet is coded against: lat, lon, ip, port, radac port"""
+        return [0, 0, 0, 0, DEFAULT_RADAC_PORT]
+
+    def pack_v3(self, now, ref):
+        """
+        Returns the v3 (compressed v2) record of the Node, and moves ref on to it.
+        node_id (4 bytes) is followed by varints: the zigzag deltas of lat and lon,
+        coord_range, ip XOR the previous ip and the zigzag delta of port. Then come
+        flags (1 byte), radac ip XOR ip and radac port XOR the previous radac port if
+        flagged, and the age. The previous record of the first one is v3_reference().
+        """
+        ip = _ip2int(self.address[0])
+        radac_ip = _ip2int(self.radac_address[0])
+        radac_port = self.radac_address[1]
+        flags = self._accepts_flags()
+        if radac_ip != ip:
+            flags |= self.V2_RADAC_IP
+        if radac_port != ref[4]:
+            flags |= self.V2_RADAC_PORT
+
+        lat, lon = self._fixed_position()
+        p = struct.pack('!I', self.node_id)
+        p += _pack_varint(_zigzag(lat - ref[0])) + _pack_varint(_zigzag(lon - ref[1]))
+        p += _pack_varint(self.coord_range) + _pack_varint(ip ^ ref[2])
+        p += _pack_varint(_zigzag(self.address[1] - ref[3])) + struct.pack('!B', flags)
+        if flags & self.V2_RADAC_IP:
+            p += _pack_varint(radac_ip ^ ip)
+        if flags & self.V2_RADAC_PORT:
+            p += _pack_varint(radac_port ^ ref[4])
+        ref[:] = [lat, lon, ip, self.address[1], radac_port]
+        return p + _pack_varint(max(0, now - self.timestamp))
+
+    @classmethod
+    def from_bytes_v3(cls, b, now, ref):
+        """
+        Construct a Node from the v3 record at the start of b, see pack_v3.
+        Returns the Node and the size of the record, or (None, 0) if b is too short.
+        """
+        if len(b) < 4:
+            return None, 0
+        node_id = struct.unpack('!I', b[:4])[0]
+        offset = 4
+        values = []
+        for i in range(5):
+            value, size = _unpack_varint(b[offset:])
+            if size == 0:
+                return None, 0
+            values.append(value)
+            offset += size
+        if len(b) <= offset:
+            return None, 0
+        flags = bytearray(b[offset:offset + 1])[0]
+        offset += 1
+        radac_ip, radac_port = 0, 0
+        if flags & cls.V2_RADAC_IP:
+            radac_ip, size = _unpack_varint(b[offset:])
+            if size == 0:
+                return None, 0
+            offset += size
+        if flags & cls.V2_RADAC_PORT:
+            radac_port, size = _unpack_varint(b[offset:])
+            if size == 0:
+                return None, 0
+            offset += size
+        age, size = _unpack_varint(b[offset:])
+        if size == 0:
+            return None, 0
+
+        ref[0] += _unzigzag(values[0])
+        ref[1] += _unzigzag(values[1])
+        ref[2] ^= values[3]
+        ref[3] += _unzigzag(values[4])
+        ref[4] ^= radac_port
+        node = cls(node_id, ref[0] / 1000000.0, ref[1] / 1000000.0, values[2],
+                   _int2ip(ref[2]), ref[3], _int2ip(ref[2] ^ radac_ip), ref[4],
+                   max(0, now - age), cls._accepts_from_flags(flags))
+        return node, offset + size
+
 # Helper functions
 def _ip2int(addr):
     """Convert ip from repr format to int"""
@@ -292,3 +501,29 @@ def _ip2int(addr):
 def _int2ip(addr):
     """Convert ip from int to repr format"""
     return socket.inet_ntoa(struct.pack("!I", addr))   
+
+def _pack_varint(i):
+    """Unsigned LEB128: 7 bits per byte, lowest first, high bit set on all but the last"""
+    b = bytearray()
+    while i >= 0x80:
+        b.append((i & 0x7f) | 0x80)
+        i >>= 7
+    b.append(i)
+    return bytes(b)
+
+def _zigzag(i):
+    """Signed to unsigned for varints: 0, -1, 1, -2 ... to 0, 1, 2, 3 ..."""
+    return (i << 1) ^ -1 if i < 0 else i << 1
+
+def _unzigzag(i):
+    return -((i + 1) >> 1) if i & 1 else i >> 1
+
+def _unpack_varint(b):
+    """Returns the value of the varint at the start of b and its size, (0, 0) if malformed"""
+    value = 0
+    for n in range(min(len(b), 5)):
+        byte = bytearray(b[n:n + 1])[0]
+        value |= (byte & 0x7f) << (7 * n)
+        if not byte & 0x80:
+            return value, n + 1
+    return 0, 0
@@ -0,0 +1,636 @@
+/*
+ * benchnode.c
+ *
+ *	Micro-benchmarks for the hot paths in node.c.
+ *	Build and run with "make bench". Not part of the p2p-dprd binary.
+ *
+ */
+#include <time.h>
+
+#include "node.h"
+#include "serialize.h"
+
+/* Define global CONFIG, as in p2p-dprd.c */
+Config* CONFIG;
+
+/* qsort() subroutines in node.c, for comparison */
+int comp_sort_utility_h2l(const Node* a, const Node* b);
+int comp_sort_timestamp_h2l(const Node* a, const Node* b);
+int comp_sort_id(const Node* a, const Node* b);
+
+#define BENCH_NODES		10000
+#define BENCH_ROUNDS	200
+#define BENCH_LARGE		10000	/* Size of the "large" tables of the sort and thread benchmarks */
+#define BENCH_THRESHOLD_STEPS	500	/* Nodes each side of the candidate threshold in bench_utility() */
+#define BENCH_PORT		47400	/* Ports of bench_preallocated() on localhost: ours, */
+#define BENCH_PEER_PORT	47401	/* and the one all peers are at */
+
+/* Wall-clock time in seconds */
+static double bench_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#ifdef P2PDPRD_FIXED_POINT
+#define BENCH_POSITIONS "fixed-point"
+#else
+#define BENCH_POSITIONS "unit vectors"
+#endif
+
+/* Node_utility() as it was before the cached unit vectors, for comparison */
+static double bench_utility_haversine(Node* a, Node* b){
+	double ab_dist_sqrd = pow((geo_distance_meters(Node_lat(a), Node_lon(a), Node_lat(b), Node_lon(b))), 2);
+	double ab_cr_sqrd = pow(a->coordRange + b->coordRange, 2);
+	return ab_dist_sqrd != 0 ? ab_cr_sqrd / ab_dist_sqrd : DBL_MAX;
+}
+
+/* Fills nc with count Nodes spread around own. Every 16th Node is far away
+ * (outside the range of the series in geo_chord_to_distance_sqrd()). */
+static void bench_fill(NodeCollection* nc, Node* own, int count){
+	int i;
+	for(i = 0 ; i < count ; i++){
+		double spread = (i % 16 == 0) ? 20.0 : 0.5;
+		Node* n = &nc->nodes[i];
+		memset(n, 0, sizeof(Node));
+		n->nodeID = i + 1;
+		n->timeStamp = i;
+		n->coordRange = 10 + rand() % 1000;
+		Node_setPosition(n, Node_lat(own) + spread * (rand() / (double)RAND_MAX - 0.5),
+				Node_lon(own) + spread * (rand() / (double)RAND_MAX - 0.5));
+	}
+	nc->nodeCount = count;
+}
+
+/* How far in metres the distance Node_utility() works with may be from geo_distance_meters()
+ * at dist metres, as documented with it. Negative where nothing is promised */
+static double bench_utility_tolerance(double dist){
+#ifdef P2PDPRD_FIXED_POINT
+	return dist <= 50000 ? GEO_FIXED_ABS_ERROR + GEO_FIXED_REL_ERROR * dist : -1;
+#else
+	return dist <= 15000000 ? GEO_CHORD_ERROR : -1;
+#endif
+}
+
+/* Checks Node_utility() of b against bench_utility_haversine(). Returns 1 if the distance
+ * it gives is further off than bench_utility_tolerance(), or b is a candidate (utility >= 1)
+ * where it was not before, or the other way around. The fixed-point build may only disagree
+ * on candidates within its tolerance of the coordination range. *max_err is updated with
+ * the distance error. */
+static int bench_utility_check(Node* own, Node* b, double* max_err){
+	double u_old = bench_utility_haversine(own, b);
+	double u_new = Node_utility(own, b);
+	double dist = geo_distance_meters(Node_lat(own), Node_lon(own), Node_lat(b), Node_lon(b));
+	double cr = own->coordRange + b->coordRange;
+	double tol = bench_utility_tolerance(dist);
+	double err;
+
+	if(tol < 0)
+		return 0;
+	err = fabs((u_new == DBL_MAX ? 0 : cr / sqrt(u_new)) - dist);
+	if(err > *max_err) *max_err = err;
+	if(err > tol)
+		return 1;
+#ifdef P2PDPRD_FIXED_POINT
+	if(fabs(dist - cr) <= tol)
+		return 0;
+#endif
+	return (u_new >= 1) != (u_old >= 1);
+}
+
+/* Times Node_utility() against bench_utility_haversine() and checks it on the Nodes of
+ * bench_fill() and on Nodes placed right around the candidate threshold. Returns the number
+ * of Nodes failing bench_utility_check() */
+static int bench_utility(){
+	NodeCollection* nc = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, BENCH_NODES);
+	Node* own = Node_new(1, 59.9, 10.7, 100, 0, 0, 0, 0, 0);
+	static const uint16_t ranges[] = {1, 10, 900, 65000};
+	double t0, t_old, t_new, sink = 0, max_err = 0;
+	int i, j, r, failed = 0, checked = 0;
+	Node b;
+
+	bench_fill(nc, own, BENCH_NODES);
+
+	for(i = 0 ; i < BENCH_NODES ; i++)
+		failed += bench_utility_check(own, &nc->nodes[i], &max_err);
+	checked += BENCH_NODES;
+	/* North and east of own, at the coordination range scaled by 1 + j * 1e-12 and 1 + j * 1e-6,
+	 * where the rounding of the chord and GEO_UTILITY_BAND matter */
+	for(i = 0 ; i < sizeof(ranges) / sizeof(ranges[0]) * 2 ; i++){
+		for(j = -BENCH_THRESHOLD_STEPS ; j <= BENCH_THRESHOLD_STEPS ; j++){
+			double offset = j * (i % 2 ? 1e-6 : 1e-12);
+			double deg = (own->coordRange + ranges[i / 2]) * (1 + offset) / (R * TO_RAD);
+			memset(&b, 0, sizeof(Node));
+			b.coordRange = ranges[i / 2];
+			Node_setPosition(&b, Node_lat(own) + deg, Node_lon(own));
+			failed += bench_utility_check(own, &b, &max_err);
+			Node_setPosition(&b, Node_lat(own), Node_lon(own) + deg / cos(Node_lat(own) * TO_RAD));
+			failed += bench_utility_check(own, &b, &max_err);
+			checked += 2;
+		}
+	}
+
+	t0 = bench_now();
+	for(r = 0 ; r < BENCH_ROUNDS ; r++)
+		for(i = 0 ; i < BENCH_NODES ; i++)
+			sink += bench_utility_haversine(own, &nc->nodes[i]);
+	t_old = bench_now() - t0;
+
+	t0 = bench_now();
+	for(r = 0 ; r < BENCH_ROUNDS ; r++){
+		NodeCollection_calculateUtility(nc, own);
+		sink += nc->nodes[r].utility;
+	}
+	t_new = bench_now() - t0;
+
+	printf("utility: haversine %.1f ns/node, " BENCH_POSITIONS " %.1f ns/node, "
+			"max distance error %.2e m, %d of %d Nodes off (%g)\n",
+			t_old * 1e9 / (BENCH_ROUNDS * BENCH_NODES),
+			t_new * 1e9 / (BENCH_ROUNDS * BENCH_NODES), max_err, failed, checked, sink);
+
+	Node_destroy(own);
+	NodeCollection_destroy(nc);
+	return failed;
+}
+
+static void bench_topk(){
+	NodeCollection* src = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, BENCH_NODES);
+	NodeCollection* nc = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, BENCH_NODES);
+	Node* own = Node_new(1, 59.9, 10.7, 100, 0, 0, 0, 0, 0);
+	double t0, t_sort = 0, t_topk = 0;
+	int r, k = 40;
+
+	bench_fill(src, own, BENCH_NODES);
+	NodeCollection_calculateUtility(src, own);
+
+	for(r = 0 ; r < BENCH_ROUNDS / 10 ; r++){
+		memcpy(nc->nodes, src->nodes, BENCH_NODES * sizeof(Node));
+		nc->nodeCount = BENCH_NODES;
+		t0 = bench_now();
+		NodeCollection_sortByUtility(nc);
+		NodeCollection_removeExcessNodes(nc, k);
+		t_sort += bench_now() - t0;
+
+		memcpy(nc->nodes, src->nodes, BENCH_NODES * sizeof(Node));
+		nc->nodeCount = BENCH_NODES;
+		t0 = bench_now();
+		NodeCollection_selectTopK(nc, k, ORDER_UTILITY);
+		t_topk += bench_now() - t0;
+	}
+
+	printf("top-%d: sort + removeExcess %.1f us, selectTopK %.1f us\n", k,
+			t_sort * 1e6 / (BENCH_ROUNDS / 10), t_topk * 1e6 / (BENCH_ROUNDS / 10));
+
+	Node_destroy(own);
+	NodeCollection_destroy(src);
+	NodeCollection_destroy(nc);
+}
+
+static void bench_merge(){
+	NodeCollection* src = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, BENCH_NODES);
+	NodeCollection* rn = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, BENCH_NODES);
+	NodeCollection* in = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, 32);
+	Node* own = Node_new(1, 59.9, 10.7, 100, 0, 0, 0, 0, 0);
+	double t0, t_old = 0, t_new = 0;
+	int r, i, half = BENCH_NODES / 2;
+
+	bench_fill(src, own, half);
+	NodeCollection_sortByTimeStamp(src);
+
+	for(r = 0 ; r < BENCH_ROUNDS ; r++){
+		/* A received collection: some new Nodes, some updates */
+		for(i = 0 ; i < 32 ; i++){
+			in->nodes[i] = src->nodes[rand() % half];
+			in->nodes[i].timeStamp = half + r;
+			if(i % 2)
+				in->nodes[i].nodeID = BENCH_NODES + r * 32 + i;
+		}
+		in->nodeCount = 32;
+
+		memcpy(rn->nodes, src->nodes, half * sizeof(Node));
+		rn->nodeCount = half;
+		NodeCollection_buildIndex(rn);
+		t0 = bench_now();
+		NodeCollection_merge(rn, in, 1);
+		NodeCollection_sortByTimeStamp(rn);
+		NodeCollection_removeExcessNodes(rn, half);
+		t_old += bench_now() - t0;
+
+		memcpy(rn->nodes, src->nodes, half * sizeof(Node));
+		rn->nodeCount = half;
+		NodeCollection_buildIndex(rn);
+		t0 = bench_now();
+		NodeCollection_mergeByTimeStamp(rn, in, 1, half, NULL);
+		t_new += bench_now() - t0;
+	}
+
+	printf("merge 32 into %d: merge + sort + removeExcess %.1f us, mergeByTimeStamp %.1f us\n", half,
+			t_old * 1e6 / BENCH_ROUNDS, t_new * 1e6 / BENCH_ROUNDS);
+
+	Node_destroy(own);
+	NodeCollection_destroy(src);
+	NodeCollection_destroy(rn);
+	NodeCollection_destroy(in);
+}
+
+static void bench_expiry(){
+	NodeCollection* nc = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, BENCH_NODES);
+	Node* own = Node_new(1, 59.9, 10.7, 100, 0, 0, 0, 0, 0);
+	double t0, t_first, t_rest;
+	int r, i;
+
+	bench_fill(nc, own, BENCH_NODES);
+	for(i = 0 ; i < BENCH_NODES ; i++)
+		nc->nodes[i].timeStamp = time(NULL);
+	CONFIG->PROTO_nodeMaxAge = 10800;
+
+	t0 = bench_now();
+	NodeCollection_removeExpiredNodes(nc, CONFIG->PROTO_nodeMaxAge);
+	t_first = bench_now() - t0;
+
+	t0 = bench_now();
+	for(r = 0 ; r < BENCH_ROUNDS ; r++)
+		NodeCollection_removeExpiredNodes(nc, CONFIG->PROTO_nodeMaxAge);
+	t_rest = bench_now() - t0;
+
+	printf("expiry, nothing expired: first call %.1f us, later calls %.3f us\n",
+			t_first * 1e6, t_rest * 1e6 / BENCH_ROUNDS);
+
+	Node_destroy(own);
+	NodeCollection_destroy(nc);
+}
+
+static void bench_sort(){
+	int sizes[] = {50, 500, 5000, BENCH_LARGE};
+	int s, r, i;
+
+	for(s = 0 ; s < sizeof(sizes) / sizeof(sizes[0]) ; s++){
+		int n = sizes[s];
+		int rounds = 1 + 200000 / n;
+		NodeCollection* src = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, n);
+		NodeCollection* nc = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, n);
+		Node* own = Node_new(1, 59.9, 10.7, 100, 0, 0, 0, 0, 0);
+		double t0, t_q[3] = {0, 0, 0}, t_r[3] = {0, 0, 0};
+
+		bench_fill(src, own, n);
+		for(i = 0 ; i < n ; i++){
+			src->nodes[i].nodeID = rand();
+			src->nodes[i].timeStamp = time(NULL) - rand() % 10800;
+		}
+		NodeCollection_calculateUtility(src, own);
+
+		for(r = 0 ; r < rounds ; r++){
+			nc->nodeCount = n;
+
+			memcpy(nc->nodes, src->nodes, n * sizeof(Node));
+			t0 = bench_now();
+			qsort(nc->nodes, n, sizeof(Node), (void *)comp_sort_timestamp_h2l);
+			t_q[0] += bench_now() - t0;
+			memcpy(nc->nodes, src->nodes, n * sizeof(Node));
+			t0 = bench_now();
+			NodeCollection_sortByTimeStamp(nc);
+			t_r[0] += bench_now() - t0;
+
+			memcpy(nc->nodes, src->nodes, n * sizeof(Node));
+			t0 = bench_now();
+			qsort(nc->nodes, n, sizeof(Node), (void *)comp_sort_id);
+			t_q[1] += bench_now() - t0;
+			memcpy(nc->nodes, src->nodes, n * sizeof(Node));
+			t0 = bench_now();
+			NodeCollection_sortByNodeID(nc);
+			t_r[1] += bench_now() - t0;
+
+			memcpy(nc->nodes, src->nodes, n * sizeof(Node));
+			t0 = bench_now();
+			qsort(nc->nodes, n, sizeof(Node), (void *)comp_sort_utility_h2l);
+			t_q[2] += bench_now() - t0;
+			memcpy(nc->nodes, src->nodes, n * sizeof(Node));
+			t0 = bench_now();
+			NodeCollection_sortByUtility(nc);
+			t_r[2] += bench_now() - t0;
+		}
+
+		/* Below NODE_RADIX_SORT_MIN the sortBy functions fall back to qsort() themselves */
+		printf("sort %5d nodes (qsort / %s, us): timestamp %.1f / %.1f, id %.1f / %.1f, utility %.1f / %.1f\n", n,
+				n < NODE_RADIX_SORT_MIN ? "qsort fallback" : "radix",
+				t_q[0] * 1e6 / rounds, t_r[0] * 1e6 / rounds,
+				t_q[1] * 1e6 / rounds, t_r[1] * 1e6 / rounds,
+				t_q[2] * 1e6 / rounds, t_r[2] * 1e6 / rounds);
+
+		Node_destroy(own);
+		NodeCollection_destroy(src);
+		NodeCollection_destroy(nc);
+	}
+}
+
+static void bench_parallel(){
+	int threads = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? sysconf(_SC_NPROCESSORS_ONLN) : 2;
+	NodeCollection* nc = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, BENCH_LARGE);
+	Node* own = Node_new(1, 59.9, 10.7, 100, 0, 0, 0, 0, 0);
+	WorkerPool* pool = WorkerPool_new(threads);
+	double t0, t[2] = {0, 0};
+	int r, w;
+
+	bench_fill(nc, own, BENCH_LARGE);
+	for(w = 0 ; w < 2 ; w++){
+		NodeCollection_setWorkers(nc, w ? pool : NULL);
+		for(r = 0 ; r < BENCH_ROUNDS / 10 ; r++){
+			NodeCollection_sortByNodeID(nc);
+			t0 = bench_now();
+			NodeCollection_calculateUtility(nc, own);
+			NodeCollection_sortByUtility(nc);
+			t[w] += bench_now() - t0;
+		}
+	}
+
+	printf("utility + sort %d nodes: 1 thread %.1f us, %d threads %.1f us\n", BENCH_LARGE,
+			t[0] * 1e6 / (BENCH_ROUNDS / 10), pool->numThreads, t[1] * 1e6 / (BENCH_ROUNDS / 10));
+
+	WorkerPool_destroy(pool);
+	Node_destroy(own);
+	NodeCollection_destroy(nc);
+}
+
+/* The temporaries of handling one packet and one timeout: unpacking the packet, our own Node,
+ * the NodeCollection sent back and its packed buffer, and the candidate Nodes. Allocated on
+ * the heap, and from an Arena reset after every event as the main loop does */
+static void bench_event(){
+	NodeCollection* in = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, 240);
+	NodeCollection* pkt = NodeCollection_new(P2PDPRD_VERSION_ID, RND_REQ, 32);
+	Node* own = Node_new(1, 59.9, 10.7, 100, 0, 0, 0, 0, 0);
+	Arena* arena = Arena_new(64 * 1024);
+	int rounds = BENCH_ROUNDS * 50;
+	int a, r, size, num;
+
+	bench_fill(in, own, 240);
+	bench_fill(pkt, own, 32);
+	unsigned char* packed = NodeCollection_pack(pkt, &size);
+
+	for(a = 0 ; a < 2 ; a++){
+		mem_setArena(a ? arena : NULL);
+		unsigned long allocations = mem_allocations();
+		double t0 = bench_now();
+		for(r = 0 ; r < rounds ; r++){
+			NodeCollection* nc = NodeCollection_unpack(packed, size, &num);
+			Node* ownNode = Node_createOwnNode();
+			NodeCollection* out = NodeCollection_new(P2PDPRD_VERSION_ID, RND_NOREQ, nc->nodeCount + 1);
+			memcpy(&out->nodes[0], ownNode, sizeof(Node));
+			memcpy(&out->nodes[1], nc->nodes, nc->nodeCount * sizeof(Node));
+			out->nodeCount = nc->nodeCount + 1;
+			int out_size;
+			unsigned char* buff = NodeCollection_pack(out, &out_size);
+			NodeCollection* cn = NodeCollection_getCandidateNodesNear(in, ownNode);
+
+			mem_free(buff);
+			NodeCollection_destroy(cn);
+			NodeCollection_destroy(out);
+			Node_destroy(ownNode);
+			NodeCollection_destroy(nc);
+			if(a)
+				Arena_reset(arena);
+		}
+		printf("%s event temporaries: %.2f heap allocations, %.2f us per event\n", a ? "arena" : "heap ",
+				(double)(mem_allocations() - allocations) / rounds, (bench_now() - t0) * 1e6 / rounds);
+	}
+	mem_setArena(NULL);
+
+	mem_free(packed);
+	Arena_destroy(arena);
+	Node_destroy(own);
+	NodeCollection_destroy(pkt);
+	NodeCollection_destroy(in);
+}
+
+/* Bytes per Node and time to pack and unpack an important-node exchange in each wire format.
+ * The Nodes are within a few km, on one /16 network, and up to ten minutes old */
+static void bench_wire(){
+	static const int counts[] = {10, 100, 1000};
+	static const char* names[] = {"v1", "v2", "v3 (compressed)"};
+	NodeCollection* nc = NodeCollection_new(P2PDPRD_VERSION_ID, IMP_REQ, 1000);
+	NodeCollection* out = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, 1000);
+	unsigned char* buff = mem_alloc(NC_HEADER_OFFSET + 1000 * NODE_V3_MAX_OFFSET);
+	uint32_t now = time(NULL);
+	int c, f, i, r;
+
+	for(i = 0 ; i < 1000 ; i++){
+		Node* n = &nc->nodes[i];
+		memset(n, 0, sizeof(Node));
+		n->nodeID = rand();
+		n->timeStamp = now - rand() % 600;
+		n->coordRange = 10 + rand() % 1000;
+		Node_setPosition(n, 59.9 + 0.05 * (rand() / (double)RAND_MAX - 0.5),
+				10.7 + 0.1 * (rand() / (double)RAND_MAX - 0.5));
+		n->ipAddr = 0x0a010000 | (rand() & 0xffff);
+		n->port = CFG_DEFAULT_PORT;
+		n->radac_ip = n->ipAddr;
+		n->radac_port = CFG_DEFAULT_RADAC_PORT;
+		n->wireVersion = P2PDPRD_VERSION_ID_V3;
+	}
+
+	for(c = 0 ; c < 3 ; c++){
+		int rounds = BENCH_ROUNDS * 10000 / counts[c];
+		nc->nodeCount = counts[c];
+		for(f = P2PDPRD_VERSION_ID ; f <= P2PDPRD_VERSION_ID_V3 ; f++){
+			int size = 0;
+			nc->versionID = f;
+			double t0 = bench_now();
+			for(r = 0 ; r < rounds ; r++)
+				size = NodeCollection_packTo(nc, buff, NC_HEADER_OFFSET + 1000 * NODE_V3_MAX_OFFSET);
+			double t_pack = bench_now() - t0;
+			t0 = bench_now();
+			for(r = 0 ; r < rounds ; r++)
+				NodeCollection_unpackTo(buff, size, out);
+			double t_unpack = bench_now() - t0;
+			printf("wire %4d nodes %-16s %5.1f bytes/node, pack %5.1f ns/node, unpack %5.1f ns/node\n",
+					counts[c], names[f - 1], (double)(size - NC_HEADER_OFFSET) / counts[c],
+					t_pack * 1e9 / rounds / counts[c], t_unpack * 1e9 / rounds / counts[c]);
+		}
+	}
+
+	free(buff);
+	NodeCollection_destroy(out);
+	NodeCollection_destroy(nc);
+}
+
+/* Resident memory of the process in bytes */
+static long bench_resident(){
+	long pages = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if(f){
+		if(fscanf(f, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* A table grown to n Nodes the way importantNodes is, and the cost of merging one packet of
+ * 32 Nodes (half of them new) into it, by nodeID and by time stamp */
+static void bench_large(){
+	int sizes[] = {10000, 100000, 1000000};
+	int s, r, i;
+
+	for(s = 0 ; s < sizeof(sizes) / sizeof(sizes[0]) ; s++){
+		int n = sizes[s];
+		int rounds = n >= 1000000 ? 5 : 50;
+		long rss0 = bench_resident();
+		NodeCollection* nc = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, 240);
+		NodeCollection* in = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, 32);
+		Node* own = Node_new(1, 59.9, 10.7, 100, 0, 0, 0, 0, 0);
+		double t0, t_grow, t_merge = 0, t_mergeTs = 0;
+
+		NodeCollection_reserve(nc, P2PDPRD_NODES_MAX_SIZE);
+		NodeCollection_buildIndex(nc);
+		t0 = bench_now();
+		for(i = 0 ; i < n ; i++){
+			if(nc->nodeCount == nc->maxNodeCount)
+				NodeCollection_grow(nc, 40);
+			Node x;
+			memset(&x, 0, sizeof(x));
+			x.nodeID = i + 1;
+			x.timeStamp = n - i;	/* Newest first, as in a table sorted by time stamp */
+			x.coordRange = 10;
+			Node_setPosition(&x, 59.9 + (i % 1000) * 1e-4, 10.7 + (i / 1000) * 1e-4);
+			NodeCollection_upsert(nc, &x);
+		}
+		t_grow = bench_now() - t0;
+		long rss = bench_resident() - rss0;
+
+		for(r = 0 ; r < rounds ; r++){
+			for(i = 0 ; i < 32 ; i++){
+				in->nodes[i] = nc->nodes[rand() % n];
+				in->nodes[i].timeStamp = n + r + 1;
+				if(i % 2)
+					in->nodes[i].nodeID = n + r * 32 + i + 1;
+			}
+			in->nodeCount = 32;
+
+			t0 = bench_now();
+			NodeCollection_merge(nc, in, 0);
+			t_merge += bench_now() - t0;
+			nc->nodeCount = n;	/* Drop the new Nodes again */
+			NodeCollection_buildIndex(nc);
+
+			t0 = bench_now();
+			NodeCollection_mergeByTimeStamp(nc, in, 0, n, NULL);
+			t_mergeTs += bench_now() - t0;
+		}
+
+		printf("%7d nodes: grown in %.0f ms, %.1f MB resident (%.0f bytes/node), "
+				"packet merge %.1f us, by time stamp %.1f us\n", n,
+				t_grow * 1e3, rss / 1e6, (double)rss / n,
+				t_merge * 1e6 / rounds, t_mergeTs * 1e6 / rounds);
+
+		Node_destroy(own);
+		NodeCollection_destroy(in);
+		NodeCollection_destroy(nc);
+	}
+}
+
+/* Packets and timeouts handled as the main loop does, in the preallocated mode (see
+ * Protocol_preallocate()): random and important nodes from 40 peers, in the v1 and v3 formats,
+ * over localhost. Nothing may be allocated while handling them. Returns Protocol_allocations() */
+static unsigned long bench_preallocated(){
+	NodeCollection *in, *rn;
+	NodeCollection* pool = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, 400);
+	Node own, sender;
+	NodePage page;
+	static unsigned char packet[MAX_PAYLOAD_BYTESIZE];
+	static const payloadType types[] = {RND_REQ, IMP_REQ, RND_NOREQ, IMP_NOREQ};
+	int packets = BENCH_ROUNDS * 10, timeouts = 0;
+	int r, i, next;
+
+	CONFIG->CLIENT_id = 1;
+	CONFIG->CLIENT_lat = 59.9;
+	CONFIG->CLIENT_lon = 10.7;
+	CONFIG->NETWORK_ownIP = CONFIG->NETWORK_originPeerIP = 0x7f000001;
+	CONFIG->NETWORK_port = BENCH_PORT;
+	CONFIG->NETWORK_originPeerPort = BENCH_PEER_PORT;
+	CONFIG->PROTO_wireVersion = P2PDPRD_VERSION_ID_V3;
+	CONFIG->PROTO_N = CFG_DEFAULT_P2PDPRD_CONSTANT_N;
+	CONFIG->PROTO_M = CFG_DEFAULT_P2PDPRD_CONSTANT_M;
+	CONFIG->PROTO_K = CFG_DEFAULT_P2PDPRD_CONSTANT_K;
+	Node_initOwnNode(&own);
+
+	in = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, CONFIG->PROTO_M + CONFIG->PROTO_K);
+	rn = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, CONFIG->PROTO_N * 2);
+	Protocol_preallocate(in, rn, 4 * 1024 * 1024);
+	int sock = IO_recvSocket_init(BENCH_PORT);
+	int peerSock = IO_recvSocket_init(BENCH_PEER_PORT);
+	IO_setSendSocket(sock);
+	Arena* arena = Arena_new(64 * 1024);
+	mem_setArena(arena);
+
+	bench_fill(pool, &own, 400);
+	for(i = 0 ; i < 400 ; i++){
+		pool->nodes[i].ipAddr = 0x7f000001;
+		pool->nodes[i].port = BENCH_PEER_PORT;
+		pool->nodes[i].wireVersion = i % 2 ? P2PDPRD_VERSION_ID_V3 : P2PDPRD_VERSION_ID;
+	}
+
+	double t0 = bench_now();
+	for(r = 0 ; r < packets ; r++){
+		/* One of the peers sends 20 Nodes of the pool, newer as time goes by */
+		uint32_t now = time(NULL);
+		sender = pool->nodes[r % 40];
+		sender.timeStamp = now;
+		for(i = 0 ; i < 20 ; i++){
+			pool->nodes[(r * 20 + i) % 400].timeStamp = now - rand() % 600;
+		}
+		NodePage_begin(&page, NC_VERSION(sender.wireVersion, sender.wireVersion), types[r % 4], &sender);
+		next = 0;
+		int size = NodePage_fill(&page, pool->nodes + (r * 20) % 400, NULL, 20, &next,
+				packet + page.headSize, sizeof(packet) - page.headSize);
+		memcpy(packet, page.head, page.headSize);
+		IO_sendBytes(packet, page.headSize + size, 0x7f000001, BENCH_PORT);
+
+		Protocol_receiveFromPeer(sock, in, rn);
+		Arena_reset(arena);
+		if(r % 20 == 19){
+			Protocol_timeout(rn, in);
+			Arena_reset(arena);
+			timeouts++;
+		}
+		while(recv(peerSock, packet, sizeof(packet), MSG_DONTWAIT) > 0)
+			;
+	}
+	printf("preallocated: %d packets and %d timeouts, %lu allocations, %.1f us per packet (%d important, %d random)\n",
+			packets, timeouts, Protocol_allocations(), (bench_now() - t0) * 1e6 / packets,
+			in->nodeCount, rn->nodeCount);
+
+	mem_setArena(NULL);
+	Arena_destroy(arena);
+	close(peerSock);
+	close(sock);
+	NodeCollection_destroy(pool);
+	return Protocol_allocations();
+}
+
+int main(void){
+	CONFIG = Config_new();
+	strcpy(CONFIG->LOG_path, "/dev/null");	/* Keep log_event() out of the way, D() is off in make bench */
+	srand(1);
+	random_seed(1);
+
+	printf("Running node benchmarks (%d nodes, %d rounds)...\n", BENCH_NODES, BENCH_ROUNDS);
+	int utilityFailed = bench_utility();
+	bench_topk();
+	bench_merge();
+	bench_expiry();
+	bench_sort();
+	bench_parallel();
+	bench_event();
+	bench_wire();
+	bench_large();
+
+	/* Last, it sets up the preallocated buffers of protocol.c */
+	if(bench_preallocated() != 0){
+		printf("Allocations while handling packets and timeouts in the preallocated mode\n");
+		return EXIT_FAILURE;
+	}
+	if(utilityFailed != 0){
+		printf("Utilities further off than Node_utility() documents\n");
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
@@ -105,6 +105,15 @@ int Config_readFromFile(char* path, Config* c){
 			D(printf("\n\tNo 'origin_peer_port' found in configuration file.\n"));
 			return 0;
 		}
+		/* Read path_mtu */
+		if(config_setting_lookup_int(setting, "path_mtu", (int *)&tmp_int) && tmp_int >= 0 && tmp_int <= UINT16_MAX){
+			c->NETWORK_pathMTU = (uint16_t)tmp_int;
+			D(printf("\n\tPath MTU: %d", c->NETWORK_pathMTU));
+		} else {
+			D(printf("\n\tNo 'path_mtu' set in configuration file.\n\t"
+									"Using default value %d", CFG_DEFAULT_PATH_MTU));
+			c->NETWORK_pathMTU = CFG_DEFAULT_PATH_MTU;
+		}
 
 	}
 
@@ -178,7 +187,7 @@ int Config_readFromFile(char* path, Config* c){
 
 		/* Read protocol constant N */
 		if(config_setting_lookup_int(setting, "proto_N", (int *)&tmp_int)){
-			c->PROTO_N = (uint16_t)tmp_int;
+			c->PROTO_N = (uint32_t)tmp_int;
 			D(printf("\n\tProtocol constant N: %d", c->PROTO_N));
 		} else {
 			D(printf("\n\tNo 'proto_N' set in configuration file.\n\t"
@@ -187,7 +196,7 @@ int Config_readFromFile(char* path, Config* c){
 		}
 		/* Read protocol constant M */
 		if(config_setting_lookup_int(setting, "proto_M", (int *)&tmp_int)){
-			c->PROTO_M = (uint16_t)tmp_int;
+			c->PROTO_M = (uint32_t)tmp_int;
 			D(printf("\n\tProtocol constant M: %d", c->PROTO_M));
 		} else {
 			D(printf("\n\tNo 'proto_M' set in configuration file.\n\t"
@@ -196,13 +205,41 @@ int Config_readFromFile(char* path, Config* c){
 		}
 		/* Read protocol constant K */
 		if(config_setting_lookup_int(setting, "proto_K", (int *)&tmp_int)){
-			c->PROTO_K = (uint16_t)tmp_int;
+			c->PROTO_K = (uint32_t)tmp_int;
 			D(printf("\n\tProtocol constant K: %d", c->PROTO_K));
 		} else {
 			D(printf("\n\tNo 'proto_K' set in configuration file.\n\t"
 									"Using default value %d", CFG_DEFAULT_P2PDPRD_CONSTANT_K));
 			c->PROTO_K = CFG_DEFAULT_P2PDPRD_CONSTANT_K;
 		}
+		/* Read number of worker threads */
+		if(config_setting_lookup_int(setting, "worker_threads", (int *)&tmp_int) && tmp_int >= 1){
+			c->PROTO_workers = (uint16_t)tmp_int;
+			D(printf("\n\tWorker threads: %d", c->PROTO_workers));
+		} else {
+			D(printf("\n\tNo 'worker_threads' set in configuration file.\n\t"
+									"Using default value %d", CFG_DEFAULT_WORKER_THREADS));
+			c->PROTO_workers = CFG_DEFAULT_WORKER_THREADS;
+		}
+		/* Read memory budget */
+		if(config_setting_lookup_int(setting, "memory_budget_kb", (int *)&tmp_int) && tmp_int >= 0){
+			c->PROTO_memoryBudget = (uint32_t)tmp_int;
+			D(printf("\n\tMemory budget: %d kB", c->PROTO_memoryBudget));
+		} else {
+			D(printf("\n\tNo 'memory_budget_kb' set in configuration file.\n\t"
+									"Using default value %d", CFG_DEFAULT_MEMORY_BUDGET));
+			c->PROTO_memoryBudget = CFG_DEFAULT_MEMORY_BUDGET;
+		}
+		/* Read wire format version */
+		if(config_setting_lookup_int(setting, "wire_version", (int *)&tmp_int) &&
+				tmp_int >= P2PDPRD_VERSION_ID && tmp_int <= P2PDPRD_VERSION_ID_V3){
+			c->PROTO_wireVersion = (uint16_t)tmp_int;
+			D(printf("\n\tWire version: %d", c->PROTO_wireVersion));
+		} else {
+			D(printf("\n\tNo 'wire_version' set in configuration file.\n\t"
+									"Using default value %d", CFG_DEFAULT_WIRE_VERSION));
+			c->PROTO_wireVersion = CFG_DEFAULT_WIRE_VERSION;
+		}
 
 	}
 	/* Read debug config */
@@ -288,6 +325,10 @@ void Config_setToDefault(Config* cfg){
 	cfg->PROTO_N = CFG_DEFAULT_P2PDPRD_CONSTANT_N;
 	cfg->PROTO_M = CFG_DEFAULT_P2PDPRD_CONSTANT_M;
 	cfg->PROTO_K = CFG_DEFAULT_P2PDPRD_CONSTANT_K;
+	cfg->PROTO_workers = CFG_DEFAULT_WORKER_THREADS;
+	cfg->PROTO_memoryBudget = CFG_DEFAULT_MEMORY_BUDGET;
+	cfg->PROTO_wireVersion = CFG_DEFAULT_WIRE_VERSION;
+	cfg->NETWORK_pathMTU = CFG_DEFAULT_PATH_MTU;
 	inet_pton(AF_INET, CFG_DEFAULT_RADAC_IP, &p_ip);
 	cfg->RADAC_ip = ntohl(p_ip);
 	cfg->RADAC_port = CFG_DEFAULT_RADAC_PORT;
@@ -321,17 +362,21 @@ void Config_set(int argc, char* argv, Config* cfg){
 void Config_setNodePosition(double lat, double lon, Config* cfg){
 	cfg->CLIENT_lat = lat;
 	cfg->CLIENT_lon = lon;
+	cfg->CLIENT_positionEpoch++;
 
 	log_event(LOG_DEBUG, "Position has been updated - lat: %f, lon: %f ", lat, lon);
 }
 
 void Config_setNodeCoordinationRange(uint16_t coord_range, Config* cfg){
 	cfg->CLIENT_coordRange = coord_range;
+	cfg->CLIENT_positionEpoch++;
 	log_event(LOG_DEBUG, "Coordination range has been updated:  %d", cfg->CLIENT_coordRange);
 }
 
 Config* Config_new(){
-	return malloc(sizeof(Config));
+	Config* cfg = mem_calloc(1, sizeof(Config));
+	cfg->CLIENT_positionEpoch = 1;	/* 0 is used for "never" by Node.utilityEpoch */
+	return cfg;
 }
 
 void Config_destroy(Config* cfg){
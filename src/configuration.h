@@ -56,9 +56,13 @@
 /* Configuration default values. These are in most cases used as fallback if a paramter
    is not defined in config-file, or the config-file cannot be found/read */
 
-/* The program version ID. Hard-coded and not configurable at run-time. */
+/* The program version ID. Hard-coded and not configurable at run-time.
+ * It is also the wire format of packets, see NC_FORMAT() in serialize.h */
 #define P2PDPRD_VERSION_ID 1
-#define P2PDPRD_NODES_MAX_SIZE 10000	/* Absolute (hard limit) maximum size of a NodeCollection. */
+#define P2PDPRD_VERSION_ID_V2 2		/* Compact Node records, see Node_packV2() */
+#define P2PDPRD_VERSION_ID_V3 3		/* Compressed v2, see NODE_V3_MAX_OFFSET */
+#define P2PDPRD_NODES_MAX_SIZE 1048576	/* Absolute (hard limit) maximum size of a NodeCollection.
+										 * A packet holds at most 65535 Nodes (16-bit count). */
 
 /*
  * P2PDPRD constants default values.
@@ -94,6 +98,7 @@
 #define CFG_DEFAULT_PEER_PORT 45544			/* Port of origin peer */
 #define CFG_DEFAULT_RADAC_IP "127.0.0.1"	/* Default IP of associated radac-instance */
 #define CFG_DEFAULT_RADAC_PORT 45542		/* Default port of associated radac-instance */
+#define CFG_DEFAULT_PATH_MTU 1500			/* Largest IP packet sent to peers, 0 for no limit */
 
 /* Discovery protocol defaults. Needs to be properly defined in config-file for
    correct and useful operation of the program and discovery service. */
@@ -103,6 +108,9 @@
 #define CFG_DEFAULT_CLIENT_LAT 59.921161				/* Geo-position - latitude */
 #define CFG_DEFAULT_CLIENT_LON 10.733608				/* Geo-position - longitude */
 #define CFG_DEFAULT_NODE_AGE_LIMIT 10800				/* Default max age of Node object - in seconds */
+#define CFG_DEFAULT_WORKER_THREADS 1					/* Threads for utility calculation and sorting of large node tables */
+#define CFG_DEFAULT_MEMORY_BUDGET 0						/* Memory budget in kB, 0 allocates as needed */
+#define CFG_DEFAULT_WIRE_VERSION P2PDPRD_VERSION_ID_V3	/* Highest wire format sent to peers that accept it */
 
 /* Buffer/string size limits.
  *
@@ -121,19 +129,24 @@ typedef struct Config {
 	uint16_t	NETWORK_originPeerPort;
 	uint32_t	NETWORK_ownIP;
 	uint16_t	NETWORK_port;
+	uint16_t	NETWORK_pathMTU;		/* See Protocol_pageSize() */
 	char		LOCAL_socketPath[MAX_SOCK_PATH_LENGTH];
 	/* P2PDPRD client config */
 	uint32_t	CLIENT_id;
 	double		CLIENT_lat;
 	double		CLIENT_lon;
 	uint16_t	CLIENT_coordRange;
+	uint32_t	CLIENT_positionEpoch;	/* Incremented when position or coordination range changes */
 	/* P2PDPRD protocol config */
 	uint32_t	PROTO_nodeMaxAge;
 	uint16_t	PROTO_timeout;
 	uint32_t	PROTO_timeout_variation;
-	uint16_t	PROTO_N;
-	uint16_t	PROTO_M;
-	uint16_t	PROTO_K;
+	uint32_t	PROTO_N;
+	uint32_t	PROTO_M;
+	uint32_t	PROTO_K;
+	uint16_t	PROTO_workers;
+	uint32_t	PROTO_memoryBudget;		/* In kB, see Protocol_preallocate() */
+	uint16_t	PROTO_wireVersion;		/* P2PDPRD_VERSION_ID to P2PDPRD_VERSION_ID_V3 */
 	/* Radac-config */
 	uint32_t	RADAC_ip;
 	uint16_t	RADAC_port;
@@ -183,6 +196,8 @@ void Config_setToDefault(Config* cfg);
  *
  * 	Returns:
  * 		void
+ *
+ * 	Increments cfg->CLIENT_positionEpoch.
  */
 void Config_setNodePosition(double lat, double lon, Config* cfg);
 
@@ -194,6 +209,8 @@ void Config_setNodePosition(double lat, double lon, Config* cfg);
  *
  * 	Returns:
  * 		void
+ *
+ * 	Increments cfg->CLIENT_positionEpoch.
  */
 void Config_setNodeCoordinationRange(uint16_t coordRange, Config* cfg);
 
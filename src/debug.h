@@ -30,7 +30,7 @@
  * debug.h
  *
  *	Define/undefine 'DEBUG' macro to switch debug-mode printing on/off.
- *	Only affects output to stdout.
+ *	Only affects output to stdout. Building with -DP2PDPRD_NO_DEBUG switches it off.
  *
  *      Author: Halvdan Hoem Grelland and Jostein Aardal
  */
@@ -39,7 +39,9 @@
 #ifndef INCLUDE_DEBUG_H_
 #define INCLUDE_DEBUG_H_
 
+#ifndef P2PDPRD_NO_DEBUG
 #define DEBUG
+#endif
 
 #ifdef DEBUG
 #define D(x) x
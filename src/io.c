@@ -84,14 +84,27 @@ int IO_recvSocket_init(uint16_t port){
 }
 
 
-int IO_sendSocket_init(struct sockaddr_in* s, uint32_t ipAddr, uint16_t port){
-	/* Instantiate socket variables */
+/* Socket IO_sendVector() sends on, see IO_setSendSocket(). -1 until set, or until the first
+ * datagram is sent, which opens one to use from then on */
+static int sendSock = -1;
+
+void IO_setSendSocket(int sock){
+	sendSock = sock;
+}
+
+/* Fills in s with the address of a receiver */
+static void IO_sendAddr_init(struct sockaddr_in* s, uint32_t ipAddr, uint16_t port){
 	memset(s, 0, sizeof(*s));				/* Zero-out buffer */
 	s->sin_family = AF_INET;				/* Use IPv4 */
 	s->sin_port = htons(port);				/* Convert port to network byte order and store in s */
 	uint32_t ip_network_order = htonl(ipAddr);
 	/* Copy 32bit-encoded ip host-address to s. Address is converted to network byte order. */
 	memcpy(&(s->sin_addr), &ip_network_order, sizeof(ip_network_order));
+}
+
+int IO_sendSocket_init(struct sockaddr_in* s, uint32_t ipAddr, uint16_t port){
+	/* Instantiate socket variables */
+	IO_sendAddr_init(s, ipAddr, port);
 
 	/* Create UDP-socket instance */
 	int sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -108,11 +121,34 @@ int IO_sendSocket_init(struct sockaddr_in* s, uint32_t ipAddr, uint16_t port){
 
 /* Send byte-buffer buffer to ip */
 int IO_sendBytes(unsigned char* buffer, uint16_t buff_size, uint32_t ip, uint16_t port){
-	/* Create send-socket */
+	if(buffer == NULL){
+		log_error(CRITICAL, errno, "Tried to send a NULL-buffer");
+	}
+
+	struct iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = buff_size;
+	return IO_sendVector(&iov, 1, ip, port);
+}
+
+/* Send the buffers of iov to ip as one datagram */
+int IO_sendVector(struct iovec* iov, int iovcnt, uint32_t ip, uint16_t port){
+	/* The same socket for every datagram, see IO_setSendSocket() */
 	struct sockaddr_in s;
-	int sock = IO_sendSocket_init(&s, ip, port);
+	if(sendSock < 0){
+		sendSock = IO_sendSocket_init(&s, ip, port);
+	} else {
+		IO_sendAddr_init(&s, ip, port);
+	}
+	int sock = sendSock;
 	uint32_t ip_n = htonl(ip);	/* converted to network byte-order for presentation (ntop) */
 	int sentBytes = -1;	
+	int buff_size = 0;
+	int i;
+
+	for(i = 0 ; i < iovcnt ; i++){
+		buff_size += iov[i].iov_len;
+	}
 
 	/* Sanity checks */
 	if(buff_size <= 0){
@@ -120,23 +156,19 @@ int IO_sendBytes(unsigned char* buffer, uint16_t buff_size, uint32_t ip, uint16_
 		return -1;
 	}
 
-	if(buffer == NULL){
-		log_error(CRITICAL, errno, "Tried to send a NULL-buffer");
-	}
-
-	if (sock){
-		/* Send data on socket */
-		sentBytes  = sendto(sock,						/* Socket to send on */
-							buffer, 					/* Data to send */
-							buff_size, 					/* Size of data in bytes */
-							0,							/* No flags */
-							(struct sockaddr *)&s,		/* Address of recipient */
-							sizeof(struct sockaddr_in)	/* Size of address field */
-		);
-
-		/* Check is sendto() was successful */
+	if (sock >= 0){
+		/* Send data on socket, gathered from the buffers of iov */
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &s;							/* Address of recipient */
+		msg.msg_namelen = sizeof(struct sockaddr_in);	/* Size of address field */
+		msg.msg_iov = iov;							/* Data to send */
+		msg.msg_iovlen = iovcnt;
+		sentBytes = sendmsg(sock, &msg, 0);			/* No flags */
+
+		/* Check is sendmsg() was successful */
 		if (sentBytes < 0){
-			/* Terminal error during sendto() */
+			/* Terminal error during sendmsg() */
 			char addr_str[17];
 			log_error(CRITICAL, errno, "There was an error sending data to %s : %d", inet_ntop(AF_INET, &ip_n, addr_str, INET_ADDRSTRLEN), port);
 			exit(0);
@@ -156,8 +188,6 @@ int IO_sendBytes(unsigned char* buffer, uint16_t buff_size, uint32_t ip, uint16_
 		log_error(CRITICAL, errno, "Failed to initialize socket");
 		exit(0);
 	}
-	/* Close socket */
-	close(sock);
 	return sentBytes;
 }
 
@@ -249,7 +279,7 @@ int LocalIO_sendCandidateNodes(NodeCollection* cn, SubscriberList* subs, Node* o
 		}
 	}
 
-	free(data);
+	mem_free(data);
 
 	return bytes_total;
 }
@@ -284,6 +314,9 @@ int LocalIO_handleRequest(LocalRequest* lr, Config* config, SubscriberList* subs
 			
 		
 			int res = SubscriberList_addSub(subs, new_sub);
+			if (res != 1){
+				Subscriber_destroy(new_sub);
+			}
 
 			if (res == 1){
 				log_event(LOG_DEBUG, "Socket address %s has been subscribed to the candidate nodes service.", lr->values->sock_addr);
@@ -298,7 +331,9 @@ int LocalIO_handleRequest(LocalRequest* lr, Config* config, SubscriberList* subs
 		}
 		case UNSUB_CANDNODES:
 		{
-			int res = SubscriberList_removeSub(subs, Subscriber_new(lr->values->sock_addr, strlen(lr->values->sock_addr)));
+			Subscriber* rmv_sub = Subscriber_new(lr->values->sock_addr, strlen(lr->values->sock_addr) + 1);
+			int res = SubscriberList_removeSub(subs, rmv_sub);
+			Subscriber_destroy(rmv_sub);
 
 			if(res == 1){
 				log_event(LOG_DEBUG, "Subscriber on %s was removed from subscription list", lr->values->sock_addr);
@@ -318,9 +353,32 @@ int LocalIO_handleRequest(LocalRequest* lr, Config* config, SubscriberList* subs
 	return success;
 }
 
+/* A LocalRequest and its values, allocated together */
+typedef struct LocalRequestObject {
+	LocalRequest	request;
+	request_values	values;
+} LocalRequestObject;
+
+static Pool* localRequestPool = NULL;
+
+void LocalRequest_initPool(uint32_t count){
+	if(!localRequestPool){
+		localRequestPool = Pool_new(sizeof(LocalRequestObject), count);
+	}
+}
+
+void LocalRequest_freePool(){
+	Pool_destroy(localRequestPool);
+	localRequestPool = NULL;
+}
+
 LocalRequest* LocalRequest_new(LOCAL_REQ_TYPE req_type, double lat, double lon, uint16_t coord_range, char sock_addr[LOCAL_ADDR_MAX_LENGTH]){
-	LocalRequest* lr = malloc(sizeof(LocalRequest));
-	lr->values = malloc(sizeof(request_values));
+	LocalRequestObject* o = Pool_get(localRequestPool);
+	if(!o){
+		o = mem_new(sizeof(LocalRequestObject));
+	}
+	LocalRequest* lr = &o->request;
+	lr->values = &o->values;
 
 	lr->type = req_type;
 	lr->values->lat = lat;
@@ -332,6 +390,9 @@ LocalRequest* LocalRequest_new(LOCAL_REQ_TYPE req_type, double lat, double lon,
 }
 
 void LocalRequest_destroy(LocalRequest* lr){
-	free(lr->values);
-	free(lr);
+	if(Pool_owns(localRequestPool, lr)){
+		Pool_put(localRequestPool, lr);
+	} else {
+		mem_free(lr);
+	}
 }
@@ -41,6 +41,7 @@
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <time.h>
 #include <sys/time.h>
@@ -58,6 +59,7 @@
  * Note that UDP doesn't support packets of size > 2^16 (~65k).
  */
 #define MAX_PAYLOAD_BYTESIZE 32768 /* Assuming max 1000 nodes * ~32 bytes/node */
+#define UDP_IP_HEADER_BYTESIZE 28	/* IPv4 and UDP headers, without options */
 
 /* Max string-length of local socket address (path) */
 #define LOCAL_ADDR_MAX_LENGTH 512
@@ -142,6 +144,29 @@ int IO_recvSocket_init(uint16_t port);
  */
 int IO_sendBytes(unsigned char* buffer, uint16_t buff_size, uint32_t ip, uint16_t port);
 
+/*
+ * Set the socket IO_sendBytes() and IO_sendVector() send on
+ * 	Arguments:
+ * 		sock		- FD to a UDP socket, typically the one of IO_recvSocket_init(), so that
+ * 					  datagrams are sent from the port we listen on. Not closed by IO
+ *
+ * 	Until it is set, a socket is opened on the first send and used for every datagram after.
+ */
+void IO_setSendSocket(int sock);
+
+/*
+ * Send buffers as one datagram, with sendmsg()
+ * 	Arguments:
+ * 		iov			- Buffers to send, one after the other
+ * 		iovcnt		- Number of buffers in iov
+ * 		ip			- Network encoded IP to send to
+ * 		port		- Receiver port
+ *
+ * 	Returns:
+ * 		int sendBytes - Number of bytes sent to receiver
+ */
+int IO_sendVector(struct iovec* iov, int iovcnt, uint32_t ip, uint16_t port);
+
 /*
  * Construct and fill a new LocalRequest object
  * 	Arguments:
@@ -152,11 +177,31 @@ int IO_sendBytes(unsigned char* buffer, uint16_t buff_size, uint32_t ip, uint16_
  *
  * 	Returns:
  * 		Pointer to allocated and initialised LocalRequest object
+ *
+ * 	From the pool if there is one (see LocalRequest_initPool()), else allocated with mem_new().
  */
 LocalRequest* LocalRequest_new(LOCAL_REQ_TYPE req_type, double lat, double lon, uint16_t coord_range, char sock_addr[LOCAL_ADDR_MAX_LENGTH]);
 
 /*
- *  Free a malloc'ed LocalRequest object from memory.
+ * Keep LocalRequest objects in a pool
+ * 	Arguments:
+ * 		count	- Number of LocalRequests in the pool
+ *
+ * 	Returns:
+ * 		void
+ *
+ * 	LocalRequest_new() takes LocalRequests from the pool while there are any left,
+ * 	and LocalRequest_destroy() gives them back. Free the pool with LocalRequest_freePool().
+ */
+void LocalRequest_initPool(uint32_t count);
+
+/*
+ * Free the pool made by LocalRequest_initPool(). No pooled LocalRequest may be in use
+ */
+void LocalRequest_freePool();
+
+/*
+ *  Free a LocalRequest object from memory, or give it back to the pool.
  * 	Arguments:
  * 		lr	- Pointer to object to destroy
  *
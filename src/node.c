@@ -34,6 +34,10 @@
  *	Refer to header file for documentation.
  *
  */
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
 #include "node.h"
 
 /* Utility quicksort subroutine */
@@ -42,83 +46,272 @@ int comp_sort_utility_h2l(const Node* a, const Node* b);
 int comp_sort_timestamp_h2l(const Node* a, const Node* b);
 /* NodeID quicksort subroutine */
 int comp_sort_id(const Node* a, const Node* b);
+/* Rebuild the nodeID index of nc if it has one */
+static void NodeCollection_reindex(NodeCollection* nc);
+/* Free the Node array of nc, see NodeCollection_reserve() */
+static void NodeCollection_freeNodes(NodeCollection* nc);
+/* Add Node n to the expiry heap of nc, if it has one */
+static void NodeCollection_expiryPush(NodeCollection* nc, const Node* n);
+/* Refill the expiry heap of nc from its current Nodes */
+static void NodeCollection_expiryRebuild(NodeCollection* nc);
+/* Allocate the grid and sampler of nc with room for count Nodes */
+static NodeGrid* NodeCollection_gridFor(NodeCollection* nc, uint32_t count);
+static NodeSampler* NodeCollection_samplerFor(NodeCollection* nc, uint32_t count);
+
+/* Scratch space taken by NodeCollection_radixSort() for n Nodes (keys, keys2, idx and idx2).
+ * Also enough for NodeCollection_selectTopK() and _topKFor() */
+#define NODE_SORT_SCRATCH(n) ((size_t)(n) * (2 * sizeof(uint64_t) + 2 * sizeof(uint32_t)))
+/* Scratch space taken by NodeCollection_mergeByTimeStamp() for merging n Nodes */
+#define NODE_MERGE_SCRATCH(n) ((size_t)((n) + 1) * (sizeof(Node) + sizeof(Node*)))
 
 /* Create an empty NodeCollection of allocated size maxNodeCount
  * Returns pointer to allocated NodeCollection.
  * NOTE: Does not check validity of data.
  */
-NodeCollection* NodeCollection_new(uint16_t versionID, payloadType type, uint16_t maxNodeCount){
-	NodeCollection* nc = malloc(sizeof(NodeCollection));
+NodeCollection* NodeCollection_new(uint16_t versionID, payloadType type, uint32_t maxNodeCount){
+	NodeCollection* nc = mem_new(sizeof(NodeCollection));
 
 	nc->versionID = versionID;
 	nc->payloadType = type;
 	nc->maxNodeCount = maxNodeCount;
-	nc->nodes = malloc(sizeof(Node) * nc->maxNodeCount);
+	nc->nodes = mem_new(sizeof(Node) * nc->maxNodeCount);
 	nc->nodeCount = 0;
+	nc->reservedNodeCount = 0;
+	nc->preallocated = 0;
+	nc->index = NULL;
+	nc->indexSize = 0;
+	nc->grid = NULL;
+	nc->expiry = NULL;
+	nc->sampler = NULL;
+	nc->workers = NULL;
+	nc->scratch = NULL;
+	nc->scratchSize = 0;
+	nc->version = 0;
 
 	return nc;
 }
 
 void NodeCollection_destroy(NodeCollection* nc){
 	if(nc){
-		free(nc->nodes);
-		free(nc);
+		NodeCollection_freeNodes(nc);
+		free(nc->index);
+		if(nc->grid){
+			free(nc->grid->head);
+			free(nc->grid->next);
+			free(nc->grid);
+		}
+		if(nc->expiry){
+			free(nc->expiry->heap);
+			free(nc->expiry);
+		}
+		if(nc->sampler){
+			free(nc->sampler->prob);
+			free(nc->sampler->alias);
+			free(nc->sampler->work);
+			free(nc->sampler);
+		}
+		free(nc->scratch);
+		mem_free(nc);
+	}
+}
+
+static void NodeCollection_freeNodes(NodeCollection* nc){
+#ifdef MAP_NORESERVE
+	if(nc->reservedNodeCount && !nc->preallocated){
+		munmap(nc->nodes, (size_t)nc->reservedNodeCount * sizeof(Node));
+		return;
+	}
+#endif
+	mem_free(nc->nodes);
+}
+
+/* Reserved Node storage is a private anonymous mapping that is not backed until touched.
+ * The kernel then hands out memory a page at a time as the NodeCollection fills up, so it
+ * can grow to the reserved size without the Nodes being copied or moved. */
+void NodeCollection_reserve(NodeCollection* nc, uint32_t maxNodes){
+	if(nc->reservedNodeCount || maxNodes <= nc->maxNodeCount){
+		return;
+	}
+#ifdef MAP_NORESERVE
+	Node* nodes = mmap(NULL, (size_t)maxNodes * sizeof(Node), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(nodes == MAP_FAILED){
+		log_event(LOG_DEBUG, "Could not reserve room for %d nodes, growing by copying: %s", maxNodes, strerror(errno));
+		return;
+	}
+	memcpy(nodes, nc->nodes, nc->nodeCount * sizeof(Node));
+	mem_free(nc->nodes);
+	nc->nodes = nodes;
+	nc->reservedNodeCount = maxNodes;
+#endif
+}
+
+/* Number of Nodes the index, grid and so on of nc are sized for */
+static uint32_t NodeCollection_room(NodeCollection* nc){
+	return nc->preallocated ? nc->reservedNodeCount : nc->maxNodeCount;
+}
+
+/* Number of index slots for count Nodes, keeping the load factor at or below 1/2 */
+static uint32_t NodeCollection_indexSizeFor(uint32_t count){
+	uint32_t size = 8;
+	while(size < 2 * count){
+		size <<= 1;
+	}
+	return size;
+}
+
+/* Number of grid buckets for count Nodes */
+static uint32_t NodeGrid_bucketsFor(uint32_t count){
+	uint32_t buckets = 16;
+	while(buckets < count){
+		buckets <<= 1;
 	}
+	return buckets;
+}
+
+/* Scratch space of a preallocated NodeCollection of maxNodes Nodes */
+static size_t NodeCollection_scratchFor(uint32_t maxNodes){
+	size_t sort = NODE_SORT_SCRATCH(maxNodes), merge = NODE_MERGE_SCRATCH(NC_MAX_PACKET_NODES);
+	return sort > merge ? sort : merge;
+}
+
+/* Returns at least size bytes of scratch space. The contents are not kept from one
+ * NodeCollection_* call to the next. */
+static void* NodeCollection_scratch(NodeCollection* nc, size_t size){
+	if(size > nc->scratchSize){
+		free(nc->scratch);
+		nc->scratch = mem_alloc(size);
+		nc->scratchSize = size;
+	}
+	return nc->scratch;
+}
+
+/* Everything is sized after NodeCollection_room(), which is the preallocated size from here on */
+void NodeCollection_preallocate(NodeCollection* nc, uint32_t maxNodes){
+	if(nc->reservedNodeCount){
+		return;
+	}
+	if(maxNodes < nc->maxNodeCount){
+		maxNodes = nc->maxNodeCount;
+	}
+	nc->nodes = mem_realloc(nc->nodes, (size_t)maxNodes * sizeof(Node));
+	nc->reservedNodeCount = maxNodes;
+	nc->preallocated = 1;
+
+	NodeCollection_buildIndex(nc);
+	NodeCollection_expiryRebuild(nc);
+	NodeCollection_gridFor(nc, maxNodes);
+	NodeCollection_samplerFor(nc, maxNodes);
+	NodeCollection_scratch(nc, NodeCollection_scratchFor(maxNodes));
+}
+
+size_t NodeCollection_footprint(uint32_t maxNodes){
+	size_t size = sizeof(NodeCollection) + (size_t)maxNodes * sizeof(Node);
+	size += NodeCollection_indexSizeFor(maxNodes) * sizeof(int32_t);
+	size += sizeof(NodeExpiry) + (2 * (size_t)maxNodes + 16) * sizeof(NodeExpiryEntry);
+	size += sizeof(NodeGrid) + (NodeGrid_bucketsFor(maxNodes) + (size_t)maxNodes) * sizeof(int32_t);
+	size += sizeof(NodeSampler) + (size_t)maxNodes * (sizeof(double) + 2 * sizeof(uint32_t));
+	size += NodeCollection_scratchFor(maxNodes);
+	return size;
 }
 
 /* Grow amount of Nodes in a NodeCollection with grow_amount nodes */
 void NodeCollection_grow(NodeCollection* nc, unsigned int grow_amount){
-	if(nc->maxNodeCount + grow_amount <= P2PDPRD_NODES_MAX_SIZE){
-		nc->maxNodeCount = nc->maxNodeCount + grow_amount;
-		nc->nodes = realloc(nc->nodes, (nc->maxNodeCount) * sizeof(Node));
+	uint32_t maxNodeCount = nc->maxNodeCount + grow_amount;
+	if(maxNodeCount > P2PDPRD_NODES_MAX_SIZE || (nc->reservedNodeCount && maxNodeCount > nc->reservedNodeCount)){
+		log_event(LOG_ERROR, "List of candidate nodes reached the max limit of %d nodes",
+				nc->reservedNodeCount ? nc->reservedNodeCount : P2PDPRD_NODES_MAX_SIZE);
+		return;
+	}
 
-		log_event(LOG_DEBUG, "A NodeCollection has been grown by %d nodes", grow_amount);
+	nc->maxNodeCount = maxNodeCount;
+	if(!nc->reservedNodeCount){
+		nc->nodes = mem_realloc(nc->nodes, (nc->maxNodeCount) * sizeof(Node));
+	}
+	/* The index is sized after maxNodeCount, with room to spare */
+	if(nc->index && nc->indexSize < 2 * nc->maxNodeCount){
+		NodeCollection_buildIndex(nc);
+	}
 
-	} else {
-		log_event(LOG_ERROR, "List of candidate nodes reached the max limit of %d nodes", P2PDPRD_NODES_MAX_SIZE);
+	log_event(LOG_DEBUG, "A NodeCollection has been grown by %d nodes", grow_amount);
+}
+
+void NodeCollection_setWorkers(NodeCollection* nc, WorkerPool* pool){
+	nc->workers = pool;
+}
+
+/* Number of parts to split bulk work over nc into */
+static int NodeCollection_parts(NodeCollection* nc){
+	if(nc->workers && nc->nodeCount >= NODE_PARALLEL_MIN){
+		return nc->workers->numThreads;
 	}
+	return 1;
 }
 
-/* Heap-allocates a new Node object. Note that memory is malloced,
- * and therefore must be freed using Node_destroy().
+/* Allocates a new Node object, see mem_new(). Note that memory
+ * therefore must be freed using Node_destroy().
  *
  * Returns: Pointer to a Node
  */
 Node* Node_new
 (uint32_t nodeID, double lat, double lon, uint16_t coordRange, uint32_t ipAddr, uint16_t port, uint32_t radac_ip, uint16_t radac_port, uint32_t timeStamp){
-	Node* n = malloc(sizeof(Node));
+	Node* n = mem_new(sizeof(Node));
 
 	n->nodeID = nodeID;
-	n->lat = lat;
-	n->lon = lon;
+	Node_setPosition(n, lat, lon);
 	n->coordRange = coordRange;
 	n->ipAddr = ipAddr;
 	n->port = port;
 	n->radac_ip = radac_ip;
 	n->radac_port = radac_port;
 	n->timeStamp = timeStamp;
+	n->wireVersion = P2PDPRD_VERSION_ID;
 	/* Also, zero-initialize utility field*/
 	n->utility = 0;
+	n->utilityEpoch = 0;
 
 	return n;
 }
 
 /* Create new Node with content from CONFIG */
 Node* Node_createOwnNode() {
-    return Node_new(CONFIG->CLIENT_id,
-                             CONFIG->CLIENT_lat,
-                             CONFIG->CLIENT_lon,
-                             CONFIG->CLIENT_coordRange,
-                             CONFIG->NETWORK_ownIP,
-                             CONFIG->NETWORK_port,
-                             CONFIG->RADAC_ip,
-                             CONFIG->RADAC_port,
-                             time(NULL));
+    Node* n = mem_new(sizeof(Node));
+    Node_initOwnNode(n);
+    return n;
+}
+
+void Node_initOwnNode(Node* n){
+	n->nodeID = CONFIG->CLIENT_id;
+	Node_setPosition(n, CONFIG->CLIENT_lat, CONFIG->CLIENT_lon);
+	n->coordRange = CONFIG->CLIENT_coordRange;
+	n->ipAddr = CONFIG->NETWORK_ownIP;
+	n->port = CONFIG->NETWORK_port;
+	n->radac_ip = CONFIG->RADAC_ip;
+	n->radac_port = CONFIG->RADAC_port;
+	n->timeStamp = time(NULL);
+	n->wireVersion = CONFIG->PROTO_wireVersion;
+	n->utility = 0;
+	n->utilityEpoch = 0;
+}
+
+/* Sets lat/lon and the unit vector (or fixed-point copy) of the position. That is what the
+ * utility calculation uses, so it only needs to be computed when the position changes. */
+void Node_setPosition(Node* n, double lat, double lon){
+#ifndef P2PDPRD_COMPACT_NODES
+	n->lat = lat;
+	n->lon = lon;
+#endif
+#ifdef P2PDPRD_FIXED_POINT
+	n->fixLat = geo_fixed_degrees(lat, 90);
+	n->fixLon = geo_fixed_degrees(lon, 180);
+#else
+	geo_unit_vector(lat, lon, n->vec);
+#endif
 }
 
 /* Frees memory of a Node object */
 void Node_destroy(Node* n){
-	free(n);
+	mem_free(n);
 }
 
 /* Nulls out a Node */
@@ -136,11 +329,11 @@ void Node_swapPointers(Node** n0, Node** n1){
 }
 
 int NodeCollection_isValid(const NodeCollection* nc){
-	/* NodeCollection is 'valid' if the nodeCount is non-negative and the nodes points to non-NULL.
+	/* NodeCollection is 'valid' if the nodeCount is within the allocated Nodes.
 	 * Also, the pointer nc itself needs to be non-NULL
 	 */
 	if(nc){		/* nc is not a NULL-pointer. Check values */
-		if(nc->nodeCount > -1){
+		if(nc->nodeCount <= nc->maxNodeCount){
 			return 1;	/* Values are OK. *nc is valid */
 		} else {
 			return 0;	/* Check failed, *nc is not valid */
@@ -167,8 +360,8 @@ void NodeCollection_print(NodeCollection* nc){
 		for (k = 0 ; k < nc->nodeCount ; k++){
 			printf("%d \t - %d \t %f \t %f \t %d \t %d \t %d \t %d \t %d \t %d \n", k,
 				nc->nodes[k].nodeID,
-				nc->nodes[k].lat,
-				nc->nodes[k].lon,
+				Node_lat(&nc->nodes[k]),
+				Node_lon(&nc->nodes[k]),
 				nc->nodes[k].coordRange,
 				nc->nodes[k].ipAddr,
 				nc->nodes[k].port,
@@ -195,8 +388,8 @@ int NodeCollection_printToFile(char* file_path, char* title, NodeCollection* nc)
 			for (k = 0 ; k < nc->nodeCount ; k++){
 				fprintf(file ,"%d \t - %d \t %f \t %f \t %d \t %d \t %d \t %d \t %d \t %d \n", k,
 					nc->nodes[k].nodeID,
-					nc->nodes[k].lat,
-					nc->nodes[k].lon,
+					Node_lat(&nc->nodes[k]),
+					Node_lon(&nc->nodes[k]),
 					nc->nodes[k].coordRange,
 					nc->nodes[k].ipAddr,
 					nc->nodes[k].port,
@@ -215,8 +408,185 @@ int NodeCollection_printToFile(char* file_path, char* title, NodeCollection* nc)
 	return success;
 };
 
+/* Sorts the n (key, index) pairs in keys/idx by key (low to high) using an LSD radix sort,
+ * one byte of the key per pass, with keys2/idx2 as scratch space. Only the lowest keyBytes
+ * bytes of the keys are used, and passes where all keys have the same byte are skipped.
+ * The sort is stable. Returns 1 if the result is in keys2/idx2, 0 if it is in keys/idx. */
+static int NodeCollection_radixSortPairs(uint64_t* keys, uint32_t* idx, uint64_t* keys2, uint32_t* idx2,
+		uint32_t n, int keyBytes){
+	uint32_t hist[8][256];
+	uint32_t i;
+	int b, swapped = 0;
+
+	/* Histograms of all passes in one go */
+	memset(hist, 0, keyBytes * sizeof(hist[0]));
+	for(i = 0 ; i < n ; i++){
+		for(b = 0 ; b < keyBytes ; b++){
+			hist[b][(keys[i] >> (8 * b)) & 0xff]++;
+		}
+	}
+
+	for(b = 0 ; b < keyBytes && n > 0 ; b++){
+		uint32_t* h = hist[b];
+		if(h[(keys[0] >> (8 * b)) & 0xff] == n){
+			continue;	/* Same byte everywhere, nothing to do */
+		}
+		/* Counts to start offsets */
+		uint32_t sum = 0, c;
+		for(c = 0 ; c < 256 ; c++){
+			uint32_t t = h[c];
+			h[c] = sum;
+			sum += t;
+		}
+		for(i = 0 ; i < n ; i++){
+			uint32_t pos = h[(keys[i] >> (8 * b)) & 0xff]++;
+			keys2[pos] = keys[i];
+			idx2[pos] = idx[i];
+		}
+		uint64_t* tk = keys; keys = keys2; keys2 = tk;
+		uint32_t* ti = idx; idx = idx2; idx2 = ti;
+		swapped = !swapped;
+	}
+
+	return swapped;
+}
+
+/* A NodeCollection_radixSort() split over a WorkerPool: each part radix sorts its own
+ * range of the pairs, then the sorted runs are merged pairwise, one round at a time */
+typedef struct NodeSortTask {
+	uint64_t*		keys;
+	uint32_t*		idx;
+	uint64_t*		keys2;
+	uint32_t*		idx2;
+	uint32_t		n;
+	int				keyBytes;
+	int				runs;			/* Number of initial runs (parts of the first step) */
+	int				width;			/* Initial runs per run in the current merge round */
+} NodeSortTask;
+
+/* Start of initial run r of t */
+static uint32_t NodeSortTask_bound(NodeSortTask* t, int r){
+	if(r > t->runs)
+		r = t->runs;
+	return (uint32_t)((uint64_t)t->n * r / t->runs);
+}
+
+static void NodeSortTask_sortPart(void* arg, int part, int parts){
+	NodeSortTask* t = arg;
+	uint32_t lo = NodeSortTask_bound(t, part), hi = NodeSortTask_bound(t, part + 1);
+	if(NodeCollection_radixSortPairs(t->keys + lo, t->idx + lo, t->keys2 + lo, t->idx2 + lo, hi - lo, t->keyBytes)){
+		memcpy(t->keys + lo, t->keys2 + lo, (hi - lo) * sizeof(uint64_t));
+		memcpy(t->idx + lo, t->idx2 + lo, (hi - lo) * sizeof(uint32_t));
+	}
+}
+
+/* Merges runs 2 * part and 2 * part + 1 from keys/idx to keys2/idx2. Equal keys are taken
+ * from the first run first, which keeps the sort stable. */
+static void NodeSortTask_mergePart(void* arg, int part, int parts){
+	NodeSortTask* t = arg;
+	uint32_t lo = NodeSortTask_bound(t, 2 * part * t->width);
+	uint32_t mid = NodeSortTask_bound(t, (2 * part + 1) * t->width);
+	uint32_t hi = NodeSortTask_bound(t, (2 * part + 2) * t->width);
+	uint32_t a = lo, b = mid, o = lo;
+	while(a < mid && b < hi){
+		if(t->keys[b] < t->keys[a]){
+			t->keys2[o] = t->keys[b];
+			t->idx2[o++] = t->idx[b++];
+		} else {
+			t->keys2[o] = t->keys[a];
+			t->idx2[o++] = t->idx[a++];
+		}
+	}
+	memcpy(t->keys2 + o, t->keys + a, (mid - a) * sizeof(uint64_t));
+	memcpy(t->idx2 + o, t->idx + a, (mid - a) * sizeof(uint32_t));
+	o += mid - a;
+	memcpy(t->keys2 + o, t->keys + b, (hi - b) * sizeof(uint64_t));
+	memcpy(t->idx2 + o, t->idx + b, (hi - b) * sizeof(uint32_t));
+}
+
+/* Moves Node idx[i] of nc to position i, for all i < n. idx must be a permutation of [0, n).
+ * Done in place by following the cycles of the permutation, marking the positions that are
+ * done in idx. */
+static void NodeCollection_permute(NodeCollection* nc, uint32_t* idx, uint32_t n){
+	uint32_t i, j, k;
+	for(i = 0 ; i < n ; i++){
+		if(idx[i] == i){
+			continue;
+		}
+		Node tmp = nc->nodes[i];
+		for(j = i ; idx[j] != i ; j = k){
+			k = idx[j];
+			nc->nodes[j] = nc->nodes[k];
+			idx[j] = j;
+		}
+		nc->nodes[j] = tmp;
+		idx[j] = j;
+	}
+}
+
+/* Returns room for n sort keys, the start of the scratch space used by NodeCollection_radixSort() */
+static uint64_t* NodeCollection_sortKeys(NodeCollection* nc, uint32_t n){
+	return NodeCollection_scratch(nc, NODE_SORT_SCRATCH(n));
+}
+
+/* Sorts the Nodes of nc by key (low to high), see NodeCollection_radixSortPairs(), followed by
+ * a single pass moving the Nodes. Large NodeCollections with a WorkerPool are sorted in parallel.
+ * keys must be from NodeCollection_sortKeys() and hold nc->nodeCount entries. */
+static void NodeCollection_radixSort(NodeCollection* nc, uint64_t* keys, int keyBytes){
+	uint32_t n = nc->nodeCount;
+	if(n < 2){
+		return;
+	}
+
+	uint64_t* keys2 = keys + n;
+	uint32_t* idx = (uint32_t*)(keys2 + n);
+	uint32_t* idx2 = idx + n;
+	uint32_t i;
+	for(i = 0 ; i < n ; i++){
+		idx[i] = i;
+	}
+
+	int parts = NodeCollection_parts(nc);
+	if(parts > 1){
+		NodeSortTask t = {keys, idx, keys2, idx2, n, keyBytes, parts, 1};
+		WorkerPool_run(nc->workers, NodeSortTask_sortPart, &t, parts);
+		for(t.width = 1 ; t.width < parts ; t.width *= 2){
+			int merges = (parts + 2 * t.width - 1) / (2 * t.width);
+			WorkerPool_run(nc->workers, NodeSortTask_mergePart, &t, merges);
+			uint64_t* tk = t.keys; t.keys = t.keys2; t.keys2 = tk;
+			uint32_t* ti = t.idx; t.idx = t.idx2; t.idx2 = ti;
+		}
+		if(t.idx != idx){
+			uint32_t* ti = idx; idx = idx2; idx2 = ti;
+		}
+	} else if(NodeCollection_radixSortPairs(keys, idx, keys2, idx2, n, keyBytes)){
+		uint32_t* ti = idx; idx = idx2; idx2 = ti;
+	}
+
+	/* Permutation pass */
+	NodeCollection_permute(nc, idx, n);
+}
+
 void NodeCollection_sortByUtility(NodeCollection* nc){
-	qsort(nc->nodes, nc->nodeCount, sizeof(nc->nodes[0]), (void *)comp_sort_utility_h2l);
+	if(nc->nodeCount < NODE_RADIX_SORT_MIN){
+		qsort(nc->nodes, nc->nodeCount, sizeof(nc->nodes[0]), (void *)comp_sort_utility_h2l);
+		NodeCollection_reindex(nc);
+		nc->version++;
+		return;
+	}
+	uint64_t* keys = NodeCollection_sortKeys(nc, nc->nodeCount);
+	int i;
+	for(i = 0 ; i < nc->nodeCount ; i++){
+		/* Order-preserving map of the IEEE 754 bits: flip all bits of negative values,
+		 * only the sign bit of positive ones. Inverted again for high to low. */
+		uint64_t u;
+		memcpy(&u, &nc->nodes[i].utility, sizeof(u));
+		u = (u >> 63) ? ~u : (u | 0x8000000000000000ULL);
+		keys[i] = ~u;
+	}
+	NodeCollection_radixSort(nc, keys, 8);
+	NodeCollection_reindex(nc);
+	nc->version++;
 }
 int comp_sort_utility_h2l(const Node* a, const Node* b){
 	if(a->utility > b->utility)
@@ -227,7 +597,20 @@ int comp_sort_utility_h2l(const Node* a, const Node* b){
 		return 0;
 }
 void NodeCollection_sortByTimeStamp(NodeCollection* nc){
-	qsort(nc->nodes, nc->nodeCount, sizeof(nc->nodes[0]), (void *)comp_sort_timestamp_h2l);
+	if(nc->nodeCount < NODE_RADIX_SORT_MIN){
+		qsort(nc->nodes, nc->nodeCount, sizeof(nc->nodes[0]), (void *)comp_sort_timestamp_h2l);
+		NodeCollection_reindex(nc);
+		nc->version++;
+		return;
+	}
+	uint64_t* keys = NodeCollection_sortKeys(nc, nc->nodeCount);
+	int i;
+	for(i = 0 ; i < nc->nodeCount ; i++){
+		keys[i] = ~nc->nodes[i].timeStamp;	/* High to low */
+	}
+	NodeCollection_radixSort(nc, keys, 4);
+	NodeCollection_reindex(nc);
+	nc->version++;
 }
 
 int comp_sort_timestamp_h2l(const Node* a, const Node* b){
@@ -239,8 +622,146 @@ int comp_sort_timestamp_h2l(const Node* a, const Node* b){
 		return 0;
 }
 
+/* Restore the min-heap (key, idx) of size count below position h */
+static void topk_siftDown(double* key, int* idx, int count, int h){
+	for(;;){
+		int c = 2 * h + 1;
+		if(c >= count)
+			break;
+		if(c + 1 < count && key[c + 1] < key[c])
+			c++;
+		if(key[h] <= key[c])
+			break;
+		double tk = key[h]; key[h] = key[c]; key[c] = tk;
+		int ti = idx[h]; idx[h] = idx[c]; idx[c] = ti;
+		h = c;
+	}
+}
+
+/* Finds the count highest of the n keys and writes their positions to idx, and the keys to
+ * heap, high to low. Keeps the best keys in a min-heap of size count, with the worst kept key
+ * at the root; every other key only has to be compared with the root. */
+static void topk_select(const double* keys, int n, int count, double* heap, int* idx){
+	int i, h;
+
+	/* Fill the heap with the first count keys */
+	for(i = 0 ; i < count ; i++){
+		heap[i] = keys[i];
+		idx[i] = i;
+	}
+	for(h = count / 2 - 1 ; h >= 0 ; h--)
+		topk_siftDown(heap, idx, count, h);
+
+	/* Replace the root with each key that is better than it */
+	for(i = count ; i < n ; i++){
+		if(keys[i] > heap[0]){
+			heap[0] = keys[i];
+			idx[0] = i;
+			topk_siftDown(heap, idx, count, 0);
+		}
+	}
+
+	/* Heapsort: moving the root to the back each time leaves the heap sorted high to low */
+	for(h = count - 1 ; h > 0 ; h--){
+		double tk = heap[0]; heap[0] = heap[h]; heap[h] = tk;
+		int ti = idx[0]; idx[0] = idx[h]; idx[h] = ti;
+		topk_siftDown(heap, idx, h, 0);
+	}
+}
+
+int NodeCollection_selectTopK(NodeCollection* nc, unsigned int k, nodeOrder order){
+	int n = nc->nodeCount;
+	int count = n < k ? n : k;
+	int removed = n - count;
+	int i;
+
+	if(count <= 0){
+		for(i = 0 ; i < n ; i++)
+			Node_nullOutNode(&nc->nodes[i]);
+		nc->nodeCount = 0;
+		NodeCollection_reindex(nc);
+		nc->version++;
+		return removed;
+	}
+
+	/* Scratch: the keys, the heap, and which of the first count Nodes are kept */
+	double* keys = NodeCollection_scratch(nc, NODE_SORT_SCRATCH(n));
+	double* heap = keys + n;
+	uint32_t* kept = (uint32_t*)(heap + count);
+	int* idx = (int*)(kept + n);
+
+	for(i = 0 ; i < n ; i++)
+		keys[i] = order == ORDER_TIMESTAMP ? nc->nodes[i].timeStamp : nc->nodes[i].utility;
+	topk_select(keys, n, count, heap, idx);
+
+	/* Move the kept Nodes to the front in order. The Nodes they displace take the places they
+	 * leave behind, everything else stays put. The keys are not needed any more, their space
+	 * holds the permutation */
+	uint32_t* src = (uint32_t*)keys;
+	uint32_t j = 0;
+	memset(kept, 0, count * sizeof(uint32_t));
+	for(i = 0 ; i < n ; i++)
+		src[i] = i;
+	for(i = 0 ; i < count ; i++){
+		if(idx[i] < count)
+			kept[idx[i]] = 1;
+		src[i] = idx[i];
+	}
+	for(i = 0 ; i < count ; i++){
+		if(idx[i] < count)
+			continue;
+		while(kept[j])
+			j++;
+		src[idx[i]] = j++;
+	}
+	NodeCollection_permute(nc, src, n);
+	for(i = count ; i < n ; i++)
+		Node_nullOutNode(&nc->nodes[i]);
+	nc->nodeCount = count;
+
+	if(removed > 0)
+		log_event(LOG_DEBUG, "%d excess nodes were removed", removed);
+
+	NodeCollection_reindex(nc);
+	nc->version++;
+	return removed;
+}
+
+const int* NodeCollection_topKFor(NodeCollection* nc, Node* n, unsigned int k, int* count){
+	int total = nc->nodeCount;
+	int i;
+
+	*count = total < k ? total : k;
+	if(*count <= 0){
+		*count = 0;
+		return NULL;
+	}
+
+	double* keys = NodeCollection_scratch(nc, NODE_SORT_SCRATCH(total));
+	double* heap = keys + total;
+	int* idx = (int*)(heap + *count);
+
+	for(i = 0 ; i < total ; i++)
+		keys[i] = Node_utility(n, &nc->nodes[i]);
+	topk_select(keys, total, *count, heap, idx);
+	return idx;
+}
+
 void NodeCollection_sortByNodeID(NodeCollection* nc){
-	qsort(nc->nodes, nc->nodeCount, sizeof(nc->nodes[0]), (void *)comp_sort_id);
+	if(nc->nodeCount < NODE_RADIX_SORT_MIN){
+		qsort(nc->nodes, nc->nodeCount, sizeof(nc->nodes[0]), (void *)comp_sort_id);
+		NodeCollection_reindex(nc);
+		nc->version++;
+		return;
+	}
+	uint64_t* keys = NodeCollection_sortKeys(nc, nc->nodeCount);
+	int i;
+	for(i = 0 ; i < nc->nodeCount ; i++){
+		keys[i] = ~nc->nodes[i].nodeID;	/* High to low */
+	}
+	NodeCollection_radixSort(nc, keys, 4);
+	NodeCollection_reindex(nc);
+	nc->version++;
 }
 
 int comp_sort_id(const Node* a, const Node* b){
@@ -251,6 +772,101 @@ int comp_sort_id(const Node* a, const Node* b){
 	else
 		return 0;
 }
+/* Mix the bits of a nodeID before using it as a hash. IDs are usually random,
+ * but nothing prevents a peer from picking sequential ones. */
+static uint32_t hashNodeID(uint32_t id){
+	id ^= id >> 16;
+	id *= 0x45d9f3b;
+	id ^= id >> 16;
+	return id;
+}
+
+/* Returns the index slot holding nodeID, or the empty slot where it belongs.
+ * The index is always at least twice the size of the collection, so probing terminates. */
+static int32_t* NodeCollection_indexSlot(NodeCollection* nc, uint32_t nodeID){
+	uint32_t mask = nc->indexSize - 1;
+	uint32_t i = hashNodeID(nodeID) & mask;
+
+	while(nc->index[i] != NODE_INDEX_EMPTY && nc->nodes[nc->index[i]].nodeID != nodeID){
+		i = (i + 1) & mask;	/* Linear probing */
+	}
+	return &nc->index[i];
+}
+
+void NodeCollection_buildIndex(NodeCollection* nc){
+	uint32_t size = NodeCollection_indexSizeFor(NodeCollection_room(nc));
+	if(size != nc->indexSize){
+		nc->index = mem_realloc(nc->index, size * sizeof(int32_t));
+		nc->indexSize = size;
+	}
+	memset(nc->index, 0xff, size * sizeof(int32_t));	/* All slots = NODE_INDEX_EMPTY */
+
+	int i;
+	for(i = 0 ; i < nc->nodeCount ; i++){
+		int32_t* slot = NodeCollection_indexSlot(nc, nc->nodes[i].nodeID);
+		if(*slot == NODE_INDEX_EMPTY){
+			*slot = i;
+		}
+	}
+}
+
+static void NodeCollection_reindex(NodeCollection* nc){
+	if(nc->index){
+		NodeCollection_buildIndex(nc);
+	}
+}
+
+Node* NodeCollection_findByID(NodeCollection* nc, uint32_t nodeID){
+	if(!nc->index){
+		NodeCollection_buildIndex(nc);
+	}
+	int32_t* slot = NodeCollection_indexSlot(nc, nodeID);
+	if(*slot == NODE_INDEX_EMPTY){
+		return NULL;
+	}
+	return &nc->nodes[*slot];
+}
+
+/* Insert n into nc, or replace the Node with the same ID if n is newer */
+int NodeCollection_upsert(NodeCollection* nc, const Node* n){
+	if(!nc->index){
+		NodeCollection_buildIndex(nc);
+	}
+	int32_t* slot = NodeCollection_indexSlot(nc, n->nodeID);
+
+	if(*slot != NODE_INDEX_EMPTY){
+		/* Duplicate - keep the most recent Node */
+		if(nc->nodes[*slot].timeStamp < n->timeStamp){
+			memcpy(&nc->nodes[*slot], n, sizeof(Node));
+			NodeCollection_expiryPush(nc, n);
+			nc->version++;
+			return 1;
+		}
+		return 0;
+	}
+
+	if(nc->nodeCount >= nc->maxNodeCount){
+		return 0;	/* Full, same as NodeCollection_append() */
+	}
+	memcpy(&nc->nodes[nc->nodeCount], n, sizeof(Node));
+	*slot = nc->nodeCount;
+	nc->nodeCount++;
+	NodeCollection_expiryPush(nc, n);
+	nc->version++;
+	return 1;
+}
+
+/* Upsert all Nodes in b into a. Ignores ignoreNodeId if > 0 */
+int NodeCollection_merge(NodeCollection* a, NodeCollection* b, uint32_t ignoreNodeId){
+	int i, merged = 0;
+	for(i = 0 ; i < b->nodeCount ; i++){
+		if(ignoreNodeId == 0 || ignoreNodeId != b->nodes[i].nodeID){
+			merged += NodeCollection_upsert(a, &b->nodes[i]);
+		}
+	}
+	return merged;
+}
+
 /* Append NodeCollection b to NodeCollection a. Ignores ignoreNodeId if > 0 */
 void NodeCollection_append(NodeCollection* a, NodeCollection* b, uint32_t ignoreNodeId){
 	int b_pos = 0;
@@ -264,39 +880,212 @@ void NodeCollection_append(NodeCollection* a, NodeCollection* b, uint32_t ignore
 
         b_pos++; // always move b ahead
     }
+    /* Appended Nodes may duplicate existing IDs, so rebuild rather than insert.
+     * The same goes for the expiry heap */
+    NodeCollection_reindex(a);
+    if(a->expiry){
+        NodeCollection_expiryRebuild(a);
+    }
+    a->version++;
 }
 
-/* Remove duplicate nodes from NodeCollection nc */
+/* Remove duplicate nodes from NodeCollection nc.
+ * Compacts nc in place while building the index, keeping the most recent Node of each ID
+ * in the position of the first occurrence. */
 void NodeCollection_removeDuplicateNodes(NodeCollection* nc){
-	/* 1. Sort by nodeID to ensure identical IDs are grouped together */
-	NodeCollection_sortByNodeID(nc);
-	int i, newNodeCount = nc->nodeCount;
-	for (i = 0 ; i < nc->nodeCount - 1 ; i++){
-
-		/* Compare with index + 1 element */
-		// new and imporoved version
-		if(nc->nodes[i].nodeID == nc->nodes[i + 1].nodeID){
-			/* Found two neighbouring duplicates: (indexed from top to bottom) n0 and n1 */
-			if(nc->nodes[i].timeStamp < nc->nodes[i + 1].timeStamp){
-				/* n0 duplicate is the oldest. Null out n0 */
-				Node_nullOutNode(&nc->nodes[i]);
-				newNodeCount--;
-			} else {
-				/* n1 is the oldest (or they are of identical age).
-					   Null out n1, then swap places of n1 and n0 */
-				Node_nullOutNode(&nc->nodes[i + 1]);
-				Node_swapPointers((Node**)&nc->nodes[i], (Node**)&nc->nodes[i+1]);
-				newNodeCount--;
+	if(!nc->index){
+		NodeCollection_buildIndex(nc);
+	}
+	memset(nc->index, 0xff, nc->indexSize * sizeof(int32_t));
+
+	int i, newNodeCount = 0;
+	for (i = 0 ; i < nc->nodeCount ; i++){
+		int32_t* slot = NodeCollection_indexSlot(nc, nc->nodes[i].nodeID);
+		if(*slot == NODE_INDEX_EMPTY){
+			/* First occurrence of this ID. Move it down to the compacted part */
+			if(i != newNodeCount){
+				memcpy(&nc->nodes[newNodeCount], &nc->nodes[i], sizeof(Node));
 			}
+			*slot = newNodeCount;
+			newNodeCount++;
+		} else if(nc->nodes[*slot].timeStamp < nc->nodes[i].timeStamp){
+			/* Found a newer duplicate. Overwrite the older one */
+			memcpy(&nc->nodes[*slot], &nc->nodes[i], sizeof(Node));
+		}
+	}
+	nc->nodeCount = newNodeCount;
+	nc->version++;
+}
 
+/* Sorts pointers to Nodes by timestamp, high to low */
+static int comp_sort_timestamp_ptr_h2l(const void* a, const void* b){
+	return comp_sort_timestamp_h2l(*(const Node**)a, *(const Node**)b);
+}
+
+/* Merges b into a, keeping the limit most recent Nodes, see node.h.
+ * Both collections are walked newest first, so the first time a nodeID is seen is its most
+ * recent version and any later one can be dropped. The nodeID index of a is rebuilt on the
+ * fly over the new node array and doubles as the set of IDs seen so far.
+ * The merged Nodes are written back over the old ones. An old Node that has not been read
+ * yet when its position is written to is moved to the back of a queue first, so old Node i
+ * is at the front of the queue if i < count, and in place otherwise. At most one old Node
+ * is queued for each Node taken from b. */
+int NodeCollection_mergeByTimeStamp(NodeCollection* a, NodeCollection* b, uint32_t ignoreNodeId, unsigned int limit, NodeCollection* delta){
+	int i = 0, j = 0, count = 0, merged = 0;
+	int m = 0;
+
+	if(limit > a->maxNodeCount){
+		limit = a->maxNodeCount;
+	}
+
+	/* Scratch: the queue, then pointers to the incoming Nodes */
+	Node* queue = NodeCollection_scratch(a, NODE_MERGE_SCRATCH(b->nodeCount));
+	const Node** in = (const Node**)(queue + b->nodeCount + 1);
+	int queueSize = b->nodeCount + 1, head = 0, tail = 0;
+
+	/* Sort (pointers to) the incoming Nodes, leaving out our own */
+	for(j = 0 ; j < b->nodeCount ; j++){
+		if(ignoreNodeId == 0 || ignoreNodeId != b->nodes[j].nodeID){
+			in[m++] = &b->nodes[j];
 		}
+	}
+	qsort(in, m, sizeof(Node*), comp_sort_timestamp_ptr_h2l);
 
+	/* Make room in the expiry heap up front, it can not be rebuilt halfway through */
+	if(a->expiry && a->expiry->count + m > a->expiry->size){
+		NodeCollection_expiryRebuild(a);
+	}
+
+	int oldCount = a->nodeCount;
+	a->nodeCount = 0;
+	if(!a->index){
+		NodeCollection_buildIndex(a);
+	}
+	memset(a->index, 0xff, a->indexSize * sizeof(int32_t));	/* All slots = NODE_INDEX_EMPTY */
+
+	j = 0;
+	while(count < limit && (i < oldCount || j < m)){
+		const Node* old = i >= oldCount ? NULL : (i < count ? &queue[head] : &a->nodes[i]);
+		Node n;
+		int fromB;
+		/* On equal timestamps the Node already in a goes first, as in NodeCollection_upsert() */
+		if(j >= m || (old && old->timeStamp >= in[j]->timeStamp)){
+			n = *old;
+			if(i++ < count){
+				head = (head + 1) % queueSize;
+			}
+			fromB = 0;
+		} else {
+			n = *in[j++];
+			fromB = 1;
+		}
+
+		int32_t* slot = NodeCollection_indexSlot(a, n.nodeID);
+		if(*slot != NODE_INDEX_EMPTY){
+			continue;	/* An at least as recent version is already kept */
+		}
+		if(count >= i && count < oldCount){
+			queue[tail] = a->nodes[count];
+			tail = (tail + 1) % queueSize;
+		}
+		a->nodes[count] = n;
+		*slot = count;
+		a->nodeCount = ++count;
+		if(fromB){
+			NodeCollection_expiryPush(a, &n);
+			merged++;
+			if(delta && delta->nodeCount < delta->maxNodeCount){
+				memcpy(&delta->nodes[delta->nodeCount++], &n, sizeof(Node));
+			}
+		}
+	}
+
+	if(count < oldCount){
+		memset(&a->nodes[count], 0, (oldCount - count) * sizeof(Node));
+	}
+	a->nodeCount = count;
+	/* Nothing taken from b and nothing dropped: the Nodes of a are as they were */
+	if(merged > 0 || count != oldCount){
+		a->version++;
+	}
+
+	if(delta && merged > 0){
+		NodeCollection_reindex(delta);
+		delta->version++;
+	}
+	return merged;
+}
+
+/* Restore the expiry heap below position h */
+static void NodeExpiry_siftDown(NodeExpiry* e, uint32_t h){
+	NodeExpiryEntry* heap = e->heap;
+	for(;;){
+		uint32_t c = 2 * h + 1;
+		if(c >= e->count)
+			break;
+		if(c + 1 < e->count && heap[c + 1].timeStamp < heap[c].timeStamp)
+			c++;
+		if(heap[h].timeStamp <= heap[c].timeStamp)
+			break;
+		NodeExpiryEntry t = heap[h]; heap[h] = heap[c]; heap[c] = t;
+		h = c;
 	}
-	/* We need to ensure that null-Nodes are placed on the bottom of our
-	 * NodeCollection. Therefore, we sort by ID again
-	 */
-	NodeCollection_sortByNodeID(nc);
-	nc->nodeCount = newNodeCount;
+}
+
+/* Refill the expiry heap of nc from its current Nodes, dropping all stale entries */
+static void NodeCollection_expiryRebuild(NodeCollection* nc){
+	NodeExpiry* e = nc->expiry;
+	if(!e){
+		e = nc->expiry = mem_calloc(1, sizeof(NodeExpiry));
+	}
+	if(e->size < 2 * NodeCollection_room(nc) + 16){
+		e->size = 2 * NodeCollection_room(nc) + 16;
+		e->heap = mem_realloc(e->heap, e->size * sizeof(NodeExpiryEntry));
+	}
+	int i;
+	e->count = 0;
+	for(i = 0 ; i < nc->nodeCount ; i++){
+		e->heap[e->count].timeStamp = nc->nodes[i].timeStamp;
+		e->heap[e->count].nodeID = nc->nodes[i].nodeID;
+		e->count++;
+	}
+	for(i = e->count / 2 - 1 ; i >= 0 ; i--){
+		NodeExpiry_siftDown(e, i);
+	}
+}
+
+static void NodeCollection_expiryPush(NodeCollection* nc, const Node* n){
+	NodeExpiry* e = nc->expiry;
+	if(!e){
+		return;
+	}
+	if(e->count >= e->size){
+		/* Mostly stale entries by now. n may or may not be among the Nodes of nc yet,
+		 * a second entry for it is harmless */
+		NodeCollection_expiryRebuild(nc);
+	}
+	uint32_t h = e->count++;
+	while(h > 0 && e->heap[(h - 1) / 2].timeStamp > n->timeStamp){
+		e->heap[h] = e->heap[(h - 1) / 2];
+		h = (h - 1) / 2;
+	}
+	e->heap[h].timeStamp = n->timeStamp;
+	e->heap[h].nodeID = n->nodeID;
+}
+
+/* Pop entries with time stamp <= cmprTime off the expiry heap of nc. Stops at, and returns 1 for,
+ * the first one that still matches a Node (i.e. a Node that has expired). Returns 0 otherwise. */
+static int NodeCollection_expiryPopStale(NodeCollection* nc, time_t cmprTime){
+	NodeExpiry* e = nc->expiry;
+	while(e->count > 0 && e->heap[0].timeStamp <= cmprTime){
+		Node* n = NodeCollection_findByID(nc, e->heap[0].nodeID);
+		if(n && n->timeStamp == e->heap[0].timeStamp){
+			return 1;
+		}
+		e->heap[0] = e->heap[--e->count];
+		NodeExpiry_siftDown(e, 0);
+	}
+	return 0;
 }
 
 /*
@@ -310,17 +1099,38 @@ int NodeCollection_removeExpiredNodes(NodeCollection* nc, unsigned int expire_ti
 	time_t cmprTime = time(NULL) - CONFIG->PROTO_nodeMaxAge;
 
 	int i = 0;
-	/* Null out node if timestamp too old and update the newNodeCount*/
+	if(!nc->expiry){
+		NodeCollection_expiryRebuild(nc);
+	}
+	/* Usually nothing has expired. Find out from the top of the expiry heap before touching nodes */
+	if(!NodeCollection_expiryPopStale(nc, cmprTime)){
+		return 0;
+	}
+
+	/* Move the nodes that are kept up over the expired ones. This keeps their order,
+	 * so a NodeCollection sorted by timestamp or utility stays sorted */
+	int j = 0;
 	for(i = 0; i < nc->nodeCount; i++){
 		if(nc->nodes[i].timeStamp <= cmprTime){
-			Node_nullOutNode(&nc->nodes[i]);
 			newNodeCount--;
 			num++;
+		} else {
+			if(j != i){
+				memcpy(&nc->nodes[j], &nc->nodes[i], sizeof(Node));
+			}
+			j++;
 		}
 	}
-	/* Make sure the nulled out nodes are at the bottom before updating nc->nodeCount */
-	NodeCollection_sortByNodeID(nc);
+	/* Null out the nodes left at the bottom before updating nc->nodeCount */
+	for(i = newNodeCount; i < nc->nodeCount; i++){
+		Node_nullOutNode(&nc->nodes[i]);
+	}
 	nc->nodeCount = newNodeCount;
+	NodeCollection_reindex(nc);
+	nc->version++;
+
+	/* All entries for the removed nodes are stale now */
+	NodeCollection_expiryPopStale(nc, cmprTime);
 
 	return num;
 }
@@ -331,7 +1141,7 @@ int NodeCollection_removeExcessNodes(NodeCollection* nc, unsigned int floor_valu
 	/* Executes only if needed */
 	if(nc->nodeCount > floor_value){
 		int i;
-		for(i = floor_value ; i < nc->maxNodeCount ; i++){
+		for(i = floor_value ; i < nc->nodeCount ; i++){
 			Node_nullOutNode(&nc->nodes[i]);
 			nodes_removed++;
 		}
@@ -339,6 +1149,8 @@ int NodeCollection_removeExcessNodes(NodeCollection* nc, unsigned int floor_valu
 		log_event(LOG_DEBUG, "%d excess nodes were removed",(nodes_removed));
 		/* Update nodeCount*/
 		nc->nodeCount = floor_value;
+		NodeCollection_reindex(nc);
+		nc->version++;
 	}
 	return nodes_removed;
 }
@@ -360,39 +1172,232 @@ NodeCollection* NodeCollection_getCandidateNodes(NodeCollection* nc){
 	return cn;
 }
 
-Node* Node_getRandomImportantNode(NodeCollection* nc){
-	Node* n = NULL;
-	if(nc->nodeCount <= 0){
-		log_event(LOG_DEBUG, "Tried to choose a random Node from zero candidates.");
-	} else if (nc->nodeCount == 1){
-		if(nc->nodes[0].nodeID != CONFIG->CLIENT_id){
-			n = &(nc->nodes[0]);
+/* Grid cell row/column of a position. Columns are counted from the antimeridian so that
+ * they can be wrapped around modulo the number of columns. */
+static int64_t NodeGrid_row(NodeGrid* g, double lat){
+	return (int64_t)floor(lat / g->cellDeg);
+}
+static int64_t NodeGrid_col(NodeGrid* g, double lon){
+	int64_t col = (int64_t)floor((lon + 180.0) / g->colDeg) % g->numCols;
+	return col < 0 ? col + g->numCols : col;
+}
+static uint32_t NodeGrid_bucket(NodeGrid* g, int64_t row, int64_t col){
+	uint32_t h = hashNodeID((uint32_t)row * 0x9e3779b1u) ^ (uint32_t)col;
+	return hashNodeID(h) & (g->numBuckets - 1);
+}
+
+static NodeGrid* NodeCollection_gridFor(NodeCollection* nc, uint32_t count){
+	if(!nc->grid){
+		nc->grid = mem_calloc(1, sizeof(NodeGrid));
+	}
+	NodeGrid* g = nc->grid;
+	uint32_t buckets = NodeGrid_bucketsFor(count);
+	if(buckets > g->maxBuckets){
+		g->head = mem_realloc(g->head, buckets * sizeof(int32_t));
+		g->maxBuckets = buckets;
+	}
+	if(count > g->maxNodes){
+		g->next = mem_realloc(g->next, count * sizeof(int32_t));
+		g->maxNodes = count;
+	}
+	return g;
+}
+
+/* (Re)build the spatial grid of nc from scratch */
+static void NodeCollection_buildGrid(NodeCollection* nc){
+	NodeGrid* g = NodeCollection_gridFor(nc, NodeCollection_room(nc));
+
+	/* Size the cells after the largest coordination range, so that a lookup usually
+	 * only needs the 3x3 cells around a position */
+	int i;
+	g->maxCoordRange = 0;
+	for(i = 0 ; i < nc->nodeCount ; i++){
+		if(nc->nodes[i].coordRange > g->maxCoordRange)
+			g->maxCoordRange = nc->nodes[i].coordRange;
+	}
+	double cellMeters = 2.0 * g->maxCoordRange;
+	if(cellMeters < NODE_GRID_MIN_CELL_METERS)
+		cellMeters = NODE_GRID_MIN_CELL_METERS;
+	g->cellDeg = cellMeters / (R * TO_RAD);
+	g->numCols = (int64_t)ceil(360.0 / g->cellDeg);
+	g->colDeg = 360.0 / g->numCols;
+
+	g->numBuckets = NodeGrid_bucketsFor(nc->nodeCount);
+	memset(g->head, 0xff, g->numBuckets * sizeof(int32_t));
+
+	for(i = 0 ; i < nc->nodeCount ; i++){
+		uint32_t b = NodeGrid_bucket(g, NodeGrid_row(g, Node_lat(&nc->nodes[i])), NodeGrid_col(g, Node_lon(&nc->nodes[i])));
+		g->next[i] = g->head[b];
+		g->head[b] = i;
+	}
+	g->version = nc->version;
+}
+
+/* Copies nc->nodes[i] to cn with utility relative to n, if it is a candidate */
+static void NodeCollection_addIfCandidate(NodeCollection* cn, NodeCollection* nc, int i, Node* n){
+	double utility = Node_utility(n, &nc->nodes[i]);
+	if(utility >= 1.0f){
+		memcpy(&cn->nodes[cn->nodeCount], &nc->nodes[i], sizeof(Node));
+		cn->nodes[cn->nodeCount].utility = utility;
+		cn->nodeCount++;
+	}
+}
+
+NodeCollection* NodeCollection_getCandidateNodesNear(NodeCollection* nc, Node* n){
+	NodeCollection* cn = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, nc->nodeCount);
+	int i;
+
+	if(!nc->grid || !nc->grid->numBuckets || nc->grid->version != nc->version){
+		NodeCollection_buildGrid(nc);
+	}
+	NodeGrid* g = nc->grid;
+
+	/* A Node is a candidate if the distance to n is within the sum of their coordination ranges */
+	double range = (double)n->coordRange + g->maxCoordRange;
+	double rangeDeg = range / (R * TO_RAD);
+	int64_t spanRows = (int64_t)ceil(rangeDeg / g->cellDeg);
+
+	/* Columns get narrower towards the poles. Use the width at the most polar row we visit.
+	 * Two points at most that far from the equator and dlon apart are at least
+	 * 2 * R * cos(lat) * sin(dlon / 2) apart. */
+	double edgeLat = fabs(Node_lat(n)) + (spanRows + 1) * g->cellDeg;
+	double edgeCos = edgeLat < 90.0 ? cos(edgeLat * TO_RAD) : 0;
+	int64_t spanCols = NODE_GRID_MAX_SPAN + 1;
+	if(edgeCos > 0 && range < 2 * R * edgeCos){
+		double dlonDeg = 2 * asin(range / (2 * R * edgeCos)) / TO_RAD;
+		spanCols = (int64_t)ceil(dlonDeg / g->colDeg);
+	}
+
+	if(spanCols > NODE_GRID_MAX_SPAN || 2 * spanCols + 1 >= g->numCols){
+		/* The grid would not help, check every Node */
+		for(i = 0 ; i < nc->nodeCount ; i++){
+			NodeCollection_addIfCandidate(cn, nc, i, n);
 		}
-	} else {
-		int r = -1;	/* random number to choose */
+		return cn;
+	}
+
+	int64_t row0 = NodeGrid_row(g, Node_lat(n));
+	int64_t col0 = NodeGrid_col(g, Node_lon(n));
+	int64_t row, col;
+	for(row = row0 - spanRows ; row <= row0 + spanRows ; row++){
+		for(col = col0 - spanCols ; col <= col0 + spanCols ; col++){
+			int64_t wrapped = ((col % g->numCols) + g->numCols) % g->numCols;
+			int32_t pos;
+			for(pos = g->head[NodeGrid_bucket(g, row, wrapped)] ; pos != NODE_INDEX_EMPTY ; pos = g->next[pos]){
+				/* Buckets are shared between cells, skip Nodes from other cells */
+				if(NodeGrid_row(g, Node_lat(&nc->nodes[pos])) == row && NodeGrid_col(g, Node_lon(&nc->nodes[pos])) == wrapped){
+					NodeCollection_addIfCandidate(cn, nc, pos, n);
+				}
+			}
+		}
+	}
+	return cn;
+}
+
+/* Builds the alias table of nc->sampler from the weights of its Nodes: freshness, and zero for
+ * our own Node. With important set, only the range of Nodes Node_getRandomImportantNode()
+ * chooses from gets a weight. */
+static NodeSampler* NodeCollection_samplerFor(NodeCollection* nc, uint32_t count){
+	NodeSampler* s = nc->sampler;
+	if(!s){
+		s = nc->sampler = mem_calloc(1, sizeof(NodeSampler));
+	}
+	if(s->size < count){
+		s->size = count;
+		s->prob = mem_realloc(s->prob, s->size * sizeof(double));
+		s->alias = mem_realloc(s->alias, s->size * sizeof(uint32_t));
+		s->work = mem_realloc(s->work, s->size * sizeof(uint32_t));
+	}
+	return s;
+}
+
+static void NodeCollection_buildSampler(NodeCollection* nc, int important){
+	uint32_t room = NodeCollection_room(nc);
+	NodeSampler* s = NodeCollection_samplerFor(nc, room > nc->nodeCount ? room : nc->nodeCount);
+	s->version = nc->version;
+	s->important = important;
+	s->count = 0;
+
+	uint32_t n = nc->nodeCount, i;
+	if(important && n >= 10){
 		int candidateAmount = NodeCollection_countCandidateNodes(nc);
-		int nodeRange = 0;
-		/* Determine nodeRange */
-		if(nc->nodeCount < 10){
-			nodeRange = nc->nodeCount;/* One of the existing nodes will be chosen */
-		}else if(candidateAmount < 10){
-			nodeRange = 9; /* One of the ten nodes at the top of the list will be chosen */
+		if(candidateAmount < 10){
+			n = 9; /* One of the ten nodes at the top of the list will be chosen */
 		}else{
-			nodeRange = candidateAmount;/* one of the candidate nodes will be chosen */
+			n = candidateAmount;/* one of the candidate nodes will be chosen */
 		}
+	}
 
-		int i; /* We know an endless loop condition should be impossible, */
-		for(i = 0 ; i < 100 ; i ++){	/* however, always good to be safe and specify a max amount of iterations */
-			/* Choose a random number within the range given in nodeRange */
-			r = rand() % nodeRange;
-			if(nc->nodes[r].nodeID != CONFIG->CLIENT_id){
-				n = &(nc->nodes[r]);
-				log_event(LOG_DEBUG, "Chose a random Node with ID: %d", nc->nodes[r].nodeID);
-				break;
-			}
+	/* Weights */
+	time_t now = time(NULL);
+	double total = 0;
+	for(i = 0 ; i < n ; i++){
+		const Node* node = &nc->nodes[i];
+		double age = now > node->timeStamp ? (double)(now - node->timeStamp) : 0;
+		double w = node->nodeID == CONFIG->CLIENT_id ? 0 : 1.0 / (1.0 + age / NODE_SAMPLER_AGE_SCALE);
+		s->prob[i] = w;
+		s->alias[i] = i;
+		total += w;
+	}
+	if(total <= 0){
+		return;
+	}
+
+	/* Scale to mean 1 and pair each "small" entry with a "large" one.
+	 * work holds the small entries from the front and the large ones from the back */
+	uint32_t* work = s->work;
+	uint32_t small = 0, large = n;
+	for(i = 0 ; i < n ; i++){
+		s->prob[i] *= n / total;
+		if(s->prob[i] < 1)
+			work[small++] = i;
+		else
+			work[--large] = i;
+	}
+	while(small > 0 && large < n){
+		uint32_t sm = work[--small];
+		uint32_t lg = work[large];
+		s->alias[sm] = lg;
+		s->prob[lg] -= 1 - s->prob[sm];
+		if(s->prob[lg] < 1){
+			large++;
+			work[small++] = lg;
 		}
 	}
-	return n;
+	/* Whatever is left is 1 up to rounding */
+	for(i = 0 ; i < small ; i++)
+		s->prob[work[i]] = 1;
+	for(i = large ; i < n ; i++)
+		s->prob[work[i]] = 1;
+
+	s->count = n;
+}
+
+/* Chooses a random Node using the alias table of nc, which is rebuilt first if nc has changed */
+static Node* NodeCollection_sample(NodeCollection* nc, int important){
+	if(nc->nodeCount <= 0){
+		log_event(LOG_DEBUG, "Tried to choose a random Node from zero candidates.");
+		return NULL;
+	}
+	NodeSampler* s = nc->sampler;
+	if(!s || s->version != nc->version || s->important != important){
+		NodeCollection_buildSampler(nc, important);
+		s = nc->sampler;
+	}
+	if(s->count == 0){
+		return NULL;	/* Only our own Node */
+	}
+
+	uint32_t r = random_below(s->count);
+	if(random_double() >= s->prob[r]){
+		r = s->alias[r];
+	}
+	log_event(LOG_DEBUG, "Chose a random Node with ID: %d", nc->nodes[r].nodeID);
+	return &nc->nodes[r];
+}
+
+Node* Node_getRandomImportantNode(NodeCollection* nc){
+	return NodeCollection_sample(nc, 1);
 }
 
 /* Returns amount of candidate nodes in NodeCollection pointed to by in */
@@ -408,65 +1413,112 @@ int NodeCollection_countCandidateNodes(NodeCollection* in){
 	return counter;
 }
 
+/* Part of NodeCollection_calculateUtility() for a WorkerPool */
+typedef struct NodeUtilityTask {
+	NodeCollection*	nc;
+	Node*			n;
+} NodeUtilityTask;
+
+static void NodeUtilityTask_part(void* arg, int part, int parts){
+	NodeUtilityTask* t = arg;
+	NodeCollection* nc = t->nc;
+	int from = (int)((int64_t)nc->nodeCount * part / parts);
+	int to = (int)((int64_t)nc->nodeCount * (part + 1) / parts);
+	int i;
+	for(i = from ; i < to ; i++){
+		nc->nodes[i].utility = Node_utility(t->n, &nc->nodes[i]);
+	}
+}
+
 /* Calculate 'utility' of all nodes in nc with respect to Node n.
- * We are using geo-coordinates (lat, long) for the nodes. These need to be transformed
- * into x/y-pairs using carthesian meter-coordinates. This calculation is done using the
- * haversine() formula. See geo.h for details.
+ * We are using geo-coordinates (lat, long) for the nodes. The distance between them is
+ * calculated from the unit vectors cached in each Node (see Node_setPosition()), which
+ * gives the same result as the haversine() formula without trigonometric calls for nodes
+ * that are close. See utilities.h for details.
  *
  * The utility formula is as follows:
  *
  * utility(xi,yi,zi ; xj,yj,zj ; cri,crj) =
  * (cri + cr j )^2 / (xj − xi )^2 + (yj − yi )^2 + (zj − zi)^2
+ *
+ * Large NodeCollections with a WorkerPool are split into parts computed in parallel.
  */
 void NodeCollection_calculateUtility(NodeCollection* nc, Node* n){
-
-    int i;
-    /* Initialize variables for node a and b*/
-    for(i = 0 ; i < nc->nodeCount ; i++){
-    	nc->nodes[i].utility = Node_utility(n, &nc->nodes[i]);
-    }
+	NodeUtilityTask t = {nc, n};
+	WorkerPool_run(nc->workers, NodeUtilityTask_part, &t, NodeCollection_parts(nc));
+	nc->version++;
 }
 
-/* Packs and sends NodeCollection pointed to by nc to address:port-pair in peerNode. */
-int NodeCollection_sendToPeer(NodeCollection* nc, Node* peerNode){
-	int buff_size = 0, bytes = 0;
-	unsigned char* buff = NodeCollection_pack(nc, &buff_size);
-	bytes = IO_sendBytes(buff, buff_size, peerNode->ipAddr, peerNode->port);
+/* Recalculates the utility of the Nodes not yet calculated for epoch. A Node of cache at the same
+ * position, already calculated for epoch, lends its utility instead. Whole collections without a
+ * cache go through NodeCollection_calculateUtility(), which splits large ones over the WorkerPool */
+int NodeCollection_refreshUtility(NodeCollection* nc, Node* n, uint32_t epoch, NodeCollection* cache){
+	int i, stale = 0, count = 0;
+	for(i = 0 ; i < nc->nodeCount ; i++){
+		stale += (nc->nodes[i].utilityEpoch != epoch);
+	}
+	if(stale == 0){
+		return 0;
+	}
+
+	if(stale == nc->nodeCount && !cache){
+		/* Typically after we have moved */
+		NodeCollection_calculateUtility(nc, n);
+		for(i = 0 ; i < nc->nodeCount ; i++){
+			nc->nodes[i].utilityEpoch = epoch;
+		}
+		return stale;
+	}
 
-	free(buff);
-	return bytes;
+	for(i = 0 ; i < nc->nodeCount ; i++){
+		Node* b = &nc->nodes[i];
+		if(b->utilityEpoch == epoch){
+			continue;
+		}
+		Node* c = cache ? NodeCollection_findByID(cache, b->nodeID) : NULL;
+		if(c && c->utilityEpoch == epoch && Node_lat(c) == Node_lat(b) && Node_lon(c) == Node_lon(b) && c->coordRange == b->coordRange){
+			b->utility = c->utility;
+		} else {
+			b->utility = Node_utility(n, b);
+			count++;
+		}
+		b->utilityEpoch = epoch;
+	}
+	nc->version++;
+	return count;
 }
 
 /* Calculates utility of Node b with respects to Node a */
+#ifdef P2PDPRD_FIXED_POINT
+double Node_utility(Node* a, Node* b){
+	return geo_fixed_utility(geo_fixed_range(a->coordRange + b->coordRange),
+			geo_fixed_distance_sqrd(a->fixLat, a->fixLon, b->fixLat, b->fixLon));
+}
+#else
 double Node_utility(Node* a, Node* b){
-	double ab_dist_sqrd = pow((geo_distance_meters(a->lat, a->lon, b->lat, b->lon)), 2);
-	double ab_cr_sqrd = pow(a->coordRange + b->coordRange, 2);
+	double dx = a->vec[0] - b->vec[0];
+	double dy = a->vec[1] - b->vec[1];
+	double dz = a->vec[2] - b->vec[2];
+	double ab_dist_sqrd = geo_chord_to_distance_sqrd(dx * dx + dy * dy + dz * dz);
+	double ab_cr = a->coordRange + b->coordRange;
+	double ab_cr_sqrd = ab_cr * ab_cr;
+	double utility;
 
 	if (ab_dist_sqrd != 0)
-		return ab_cr_sqrd / ab_dist_sqrd;
+		utility = ab_cr_sqrd / ab_dist_sqrd;
 	else
-		return DBL_MAX; // If distance is 0, we return the maximal utility
+		utility = DBL_MAX; // If distance is 0, we return the maximal utility
+	if(utility > 1 - GEO_UTILITY_BAND && utility < 1 + GEO_UTILITY_BAND){
+		/* Too close to the candidate threshold for the chord, decide as before it */
+		double ab_dist = geo_distance_meters(Node_lat(a), Node_lon(a), Node_lat(b), Node_lon(b));
+		if(ab_dist != 0)
+			utility = ab_cr_sqrd / (ab_dist * ab_dist);
+		else
+			utility = DBL_MAX;
+	}
+	return utility;
 }
+#endif
 Node* Node_getRandomPeerNode(NodeCollection* nc){
-	Node* n = NULL;
-	if(nc->nodeCount <= 0){
-		log_event(LOG_DEBUG, "Tried to choose a random Node from zero candidates.");
-	} else if (nc->nodeCount == 1){
-		if(nc->nodes[0].nodeID != CONFIG->CLIENT_id){
-			n = &(nc->nodes[0]);
-		}
-	} else {
-		int r = -1;			/* random number to choose */
-		int i; 								/* We know an endless loop condition should be impossible, */
-		for(i = 0 ; i < 100 ; i ++){		/* however, always good to be safe and specify a max amount of iterations */
-			/* Choose a random number within range of the nodes */
-			r = rand() % nc->nodeCount;
-			if(nc->nodes[r].nodeID != CONFIG->CLIENT_id){
-				n = &(nc->nodes[r]);
-				log_event(LOG_DEBUG, "Chose a random Node with ID: %d", nc->nodes[r].nodeID);
-				break;
-			}
-		}
-	}
-	return n;
+	return NodeCollection_sample(nc, 0);
 }
@@ -44,6 +44,8 @@
 #include <math.h>
 #include <float.h>
 
+#include "workers.h"
+
 
 /*
  * Enumeration of NodeCollection type-identifiers.
@@ -55,32 +57,142 @@
  */
 typedef enum payloadType {RND_NOREQ, RND_REQ, IMP_NOREQ, IMP_REQ, INTERNAL} payloadType;
 
-/* Base Node data structure - holds all data associated with a single peer */
+/* Keys a NodeCollection can be ordered by, high to low. See NodeCollection_selectTopK() */
+typedef enum nodeOrder {ORDER_UTILITY, ORDER_TIMESTAMP} nodeOrder;
+
+/* Compact Node records (-DP2PDPRD_COMPACT_NODES) keep the position in fixed point only,
+ * see Node_lat(). That takes the Node from 80 to 48 bytes. */
+#if defined(P2PDPRD_COMPACT_NODES) && !defined(P2PDPRD_FIXED_POINT)
+#define P2PDPRD_FIXED_POINT
+#endif
+
+/* Base Node data structure - holds all data associated with a single peer.
+ * Fields are ordered by size to avoid padding, with the fields used by the protocol
+ * logic first and the network fields last. */
 typedef struct Node {
 	uint32_t 		nodeID;		/* Node ID - unsigned 32-bit integer */
-	double 			lat;		/* Latitudal coordinate of node position */
-	double 			lon;		/* Longitudal coordinate of node position */
+	uint32_t 		timeStamp;	/* Time since creation of Node object */
+#ifndef P2PDPRD_COMPACT_NODES
+	double 			lat;		/* Latitudal coordinate of node position. Read with Node_lat() */
+	double 			lon;		/* Longitudal coordinate of node position. Read with Node_lon() */
+#endif
+	double			utility;	/* Utility of Node */
 	uint16_t 		coordRange;	/* Node coordination range in metres */
-	uint32_t 		ipAddr;		/* Node IP-address, network encoded */
 	uint16_t		port;		/* Port node listens on */
-	uint32_t 		timeStamp;	/* Time since creation of Node object */
+	uint32_t 		ipAddr;		/* Node IP-address, network encoded */
 	uint32_t		radac_ip;	/* IP of associated RADAC instance */
 	uint16_t		radac_port;	/* Port of associated RADAC instance */
-	double			utility;	/* Utility of Node */
+	uint8_t			wireVersion;	/* Highest wire format the node accepts, P2PDPRD_VERSION_ID if not
+									 * known (0 for a bare address). Not part of the v1 record */
+#ifdef P2PDPRD_FIXED_POINT
+	int32_t			fixLat;		/* lat/lon in micro-degrees, see Node_setPosition() */
+	int32_t			fixLon;
+#else
+	double			vec[3];		/* Unit vector of lat/lon, see Node_setPosition() */
+#endif
+	uint32_t		utilityEpoch;	/* Own position epoch utility was calculated for, 0 if never.
+									 * See NodeCollection_refreshUtility() */
 } Node;
 
+/* Marks an unused slot in the nodeID hash index of a NodeCollection */
+#define NODE_INDEX_EMPTY -1
+
+/* Smallest cell size of the spatial grid, in metres. The cells are otherwise sized after
+ * the largest coordination range in the NodeCollection. */
+#define NODE_GRID_MIN_CELL_METERS 50
+/* Max number of grid columns visited on each side of a position before a lookup
+ * falls back to scanning the whole NodeCollection (very large ranges, polar positions) */
+#define NODE_GRID_MAX_SPAN 16
+/* NodeCollections with fewer Nodes than this are sorted with qsort() instead of radix sort */
+#define NODE_RADIX_SORT_MIN 64
+/* Age in seconds at which a Node is chosen half as often as a fresh one by the random peer selection */
+#define NODE_SAMPLER_AGE_SCALE 60
+/* NodeCollections with at least this many Nodes split utility calculation and sorting over
+ * their WorkerPool, if they have one. Smaller ones are faster in a single thread. */
+#define NODE_PARALLEL_MIN 2048
+
+/* Uniform lat/lon grid over the Node positions in a NodeCollection.
+ * Cells are hashed into buckets, each bucket chaining the positions of its Nodes. */
+typedef struct NodeGrid {
+	double			cellDeg;		/* Height of a cell in degrees */
+	double			colDeg;			/* Width of a cell in degrees (360 / numCols) */
+	int64_t			numCols;		/* Number of cells around a full circle of latitude */
+	uint16_t		maxCoordRange;	/* Largest coordination range of the gridded Nodes */
+	uint32_t		numBuckets;		/* Number of buckets in head (power of two) */
+	uint32_t		maxBuckets;		/* Number of buckets allocated in head */
+	uint32_t		maxNodes;		/* Number of positions allocated in next */
+	int32_t*		head;			/* First Node position in each bucket */
+	int32_t*		next;			/* Next Node position in the same bucket */
+	uint32_t		version;		/* NodeCollection version the grid was built from */
+} NodeGrid;
+
+/* Min-heap of (timeStamp, nodeID), oldest first, used to find expired Nodes without a scan.
+ * Entries are not removed when a Node is updated, moved or removed; they are recognised as
+ * stale when they reach the top (no Node with that ID and time stamp) and dropped then. */
+typedef struct NodeExpiryEntry {
+	uint32_t		timeStamp;
+	uint32_t		nodeID;
+} NodeExpiryEntry;
+
+typedef struct NodeExpiry {
+	NodeExpiryEntry*	heap;
+	uint32_t			count;
+	uint32_t			size;			/* Allocated entries */
+} NodeExpiry;
+
+/* Alias table (Vose) for choosing a random Node with given weights in O(1).
+ * Position i is chosen directly with probability prob[i], else alias[i] is chosen. */
+typedef struct NodeSampler {
+	double*			prob;
+	uint32_t*		alias;
+	uint32_t*		work;			/* Scratch space for building the table */
+	uint32_t		size;			/* Allocated entries */
+	uint32_t		count;			/* Entries in use, 0 if no Node can be chosen */
+	uint32_t		version;		/* NodeCollection.version the table was built for */
+	int				important;		/* Built for Node_getRandomImportantNode() rather than _PeerNode() */
+} NodeSampler;
+
 /* Structure holding a collection of 0 or more Node objects. */
 typedef struct NodeCollection {
 	uint16_t 		versionID;			/* Identifies program/protocol version which generated the NodeCollection. */
 	payloadType		payloadType;		/* Identifies type of NodeCollection (contents/context) */
-	uint16_t		nodeCount;			/* Actual amount of Nodes in collection*/
-	uint16_t		maxNodeCount;		/* Max amount of Nodes allocated in memory for collection */
+	uint32_t		nodeCount;			/* Actual amount of Nodes in collection*/
+	uint32_t		maxNodeCount;		/* Max amount of Nodes allocated in memory for collection */
+	uint32_t		reservedNodeCount;	/* Nodes reserved by NodeCollection_reserve() or _preallocate(), 0 if not reserved */
+	int				preallocated;		/* Set by NodeCollection_preallocate() */
 	Node*			nodes;
+	int32_t*		index;				/* Open-addressing hash index nodeID -> position in nodes. NULL until first used */
+	uint32_t		indexSize;			/* Number of slots in index (power of two) */
+	NodeGrid*		grid;				/* Spatial grid over nodes. NULL until first used */
+	NodeExpiry*		expiry;				/* Expiry heap. NULL until first NodeCollection_removeExpiredNodes() */
+	NodeSampler*	sampler;			/* Random Node selection. NULL until first used */
+	WorkerPool*		workers;			/* Threads for bulk work, not owned. NULL unless set by NodeCollection_setWorkers() */
+	void*			scratch;			/* Scratch space for sorting and merging, kept between calls */
+	size_t			scratchSize;
+	uint32_t		version;			/* Incremented whenever nodes are changed */
 } NodeCollection;
 
 #include "configuration.h"
 #include "serialize.h"
 
+/* Position of a Node in degrees. Use these rather than Node.lat/lon, which compact
+ * Nodes do not have. */
+#ifdef P2PDPRD_COMPACT_NODES
+static inline double Node_lat(const Node* n){
+	return (double)n->fixLat / GEO_FIXED_SCALE;
+}
+static inline double Node_lon(const Node* n){
+	return (double)n->fixLon / GEO_FIXED_SCALE;
+}
+#else
+static inline double Node_lat(const Node* n){
+	return n->lat;
+}
+static inline double Node_lon(const Node* n){
+	return n->lon;
+}
+#endif
+
 /* Function prototypes */
 
 /*
@@ -95,11 +207,25 @@ typedef struct NodeCollection {
  * 	Retuns:
  * 		Pointer to new Node
  *
- * 	Memory is allocated on heap, use Node_destroy() to free memory
+ * 	Memory is allocated with mem_new(), use Node_destroy() to free memory
  */
 Node* Node_new
 (uint32_t nodeID, double lat, double lon, uint16_t coordRange, uint32_t ipAddr, uint16_t port, uint32_t radac_ip, uint16_t radac_port, uint32_t timeStamp);
 
+/*
+ * Set the position of a Node
+ * 	Arguments:
+ * 		n		- Pointer to Node
+ * 		lat/lon	- Geo-position
+ * 	Returns:
+ * 		void
+ *
+ * 	Also updates the cached unit vector of the position used by Node_utility(), or the
+ * 	fixed-point position when built with P2PDPRD_FIXED_POINT.
+ * 	Always use this function (or Node_new()) to change the position of a Node.
+ */
+void Node_setPosition(Node* n, double lat, double lon);
+
 /*
  * Destroy an instance of Node
  * 	Arguments:
@@ -120,6 +246,17 @@ void Node_destroy(Node* n);
  */
 Node* Node_createOwnNode();
 
+/*
+ * Set a Node to our own Node, with content from CONFIG
+ * 	Arguments:
+ * 		n	- Pointer to Node to write to
+ * 	Returns:
+ * 		void
+ *
+ * 	Same as Node_createOwnNode(), without allocating.
+ */
+void Node_initOwnNode(Node* n);
+
 /*
  * Invalidate a Node object
  * 	Arguments:
@@ -154,8 +291,11 @@ void Node_swapPointers(Node** n0, Node** n1);
  *
  * 	Returns:
  * 		Pointer to new NodeCollection
+ *
+ * 	The NodeCollection and its Nodes are allocated with mem_new(), so a NodeCollection made
+ * 	while an event Arena is set only lives until the event is handled. Use NodeCollection_destroy()
  */
-NodeCollection* NodeCollection_new(uint16_t versionID, payloadType type, uint16_t nodeCount);
+NodeCollection* NodeCollection_new(uint16_t versionID, payloadType type, uint32_t nodeCount);
 
 /*
  * Destroy (free) a NodeCollection
@@ -176,6 +316,61 @@ void NodeCollection_destroy(NodeCollection* nc);
  */
 void NodeCollection_grow(NodeCollection* nc, unsigned int num_new_nodes);
 
+/*
+ * Reserve room for a NodeCollection to grow to, without moving its Nodes
+ * 	Arguments:
+ * 		nc			- Pointer to NodeCollection
+ * 		maxNodes	- Number of Nodes to reserve room for
+ * 	Returns:
+ * 		void
+ *
+ * 	Meant for the long-lived Node tables that may grow large. Only address space is
+ * 	reserved; memory is taken a page at a time as Nodes are added, and NodeCollection_grow()
+ * 	then no longer copies the Nodes, so pointers to them stay valid. The NodeCollection can
+ * 	not grow past maxNodes afterwards. Does nothing if the system can not reserve memory
+ * 	this way.
+ */
+void NodeCollection_reserve(NodeCollection* nc, uint32_t maxNodes);
+
+/*
+ * Allocate everything a NodeCollection will need up front
+ * 	Arguments:
+ * 		nc			- Pointer to NodeCollection
+ * 		maxNodes	- Number of Nodes to allocate for
+ * 	Returns:
+ * 		void
+ *
+ * 	For the memory budget mode (see Protocol_preallocate()). Like NodeCollection_reserve(),
+ * 	but the Nodes are allocated right away, and so are the index, expiry heap, spatial grid,
+ * 	random sampler and scratch space, all for maxNodes Nodes.
+ * 	After this, nothing in this file allocates for nc as long as it holds at most maxNodes
+ * 	Nodes and merges at most NC_MAX_PACKET_NODES at a time. NodeCollection_footprint()
+ * 	tells how much memory this takes. Does nothing if nc is already reserved.
+ */
+void NodeCollection_preallocate(NodeCollection* nc, uint32_t maxNodes);
+
+/*
+ * Get the memory taken by a preallocated NodeCollection
+ * 	Arguments:
+ * 		maxNodes	- Number of Nodes, see NodeCollection_preallocate()
+ * 	Returns:
+ * 		size_t		- Bytes allocated by NodeCollection_new() and NodeCollection_preallocate()
+ */
+size_t NodeCollection_footprint(uint32_t maxNodes);
+
+/*
+ * Let a NodeCollection split bulk work over a WorkerPool
+ * 	Arguments:
+ * 		nc		- Pointer to NodeCollection
+ * 		pool	- Pointer to WorkerPool, or NULL to go back to a single thread
+ * 	Returns:
+ * 		void
+ *
+ * 	Utility calculation and sorting use the pool once nc has NODE_PARALLEL_MIN Nodes.
+ * 	The pool is not freed by NodeCollection_destroy().
+ */
+void NodeCollection_setWorkers(NodeCollection* nc, WorkerPool* pool);
+
 /*
  * Check validity of a NodeCollection
  * 	Arguments:
@@ -234,6 +429,37 @@ void NodeCollection_sortByTimeStamp(NodeCollection* nc);
  */
 void NodeCollection_sortByUtility(NodeCollection* nc);
 
+/*
+ * Keep only the k best Nodes of a NodeCollection
+ * 	Arguments:
+ * 		nc		- Pointer to NodeCollection
+ * 		k		- Number of Nodes to keep
+ * 		order	- Key to select by (ORDER_UTILITY or ORDER_TIMESTAMP)
+ * 	Returns:
+ * 		int		- Number of Nodes removed
+ *
+ * 	Same result as sorting by the key (high to low) followed by NodeCollection_removeExcessNodes(k),
+ * 	but in O(n log k) using a bounded heap instead of a full sort.
+ * 	The kept Nodes are sorted high to low.
+ */
+int NodeCollection_selectTopK(NodeCollection* nc, unsigned int k, nodeOrder order);
+
+/*
+ * Find the k Nodes of a NodeCollection with the highest utility with respect to a Node
+ * 	Arguments:
+ * 		nc		- Pointer to NodeCollection to select from. Not changed
+ * 		n		- Pointer to Node to calculate the utility with respect to (typically a peer)
+ * 		k		- Number of Nodes to select
+ * 		count	- Used to return the number of Nodes selected
+ * 	Returns:
+ * 		int*	- Indices into nc->nodes of the selected Nodes, high to low. In the scratch
+ * 				  space of nc, valid until the next NodeCollection_* call on nc
+ *
+ * 	Same Nodes as copying nc, NodeCollection_calculateUtility(n) and NodeCollection_selectTopK(k),
+ * 	without the copy.
+ */
+const int* NodeCollection_topKFor(NodeCollection* nc, Node* n, unsigned int k, int* count);
+
 /*
  * Sort a NodeCollection by NodeID
  * 	Arguments:
@@ -261,10 +487,79 @@ void NodeCollection_append(NodeCollection* a, NodeCollection* b, uint32_t ignore
  * 	Returns:
  * 		void
  *
- * 	Removes all duplcaite Nodes (matching IDs) - keeps most recent Node
+ * 	Removes all duplcaite Nodes (matching IDs) - keeps most recent Node.
+ * 	The relative order of the remaining Nodes is preserved.
  */
 void NodeCollection_removeDuplicateNodes(NodeCollection* nc);
 
+/*
+ * (Re)build the nodeID hash index of a NodeCollection
+ * 	Arguments:
+ * 		nc	- Pointer to NodeCollection to index
+ * 	Returns:
+ * 		void
+ *
+ * 	The index is built on first use by NodeCollection_findByID() and NodeCollection_upsert(),
+ * 	and is kept up to date by the NodeCollection_* functions in this file. Code writing
+ * 	directly to nc->nodes of an indexed NodeCollection must rebuild the index afterwards.
+ */
+void NodeCollection_buildIndex(NodeCollection* nc);
+
+/*
+ * Look up a Node in a NodeCollection by its ID
+ * 	Arguments:
+ * 		nc		- Pointer to NodeCollection to search
+ * 		nodeID	- ID of Node to find
+ * 	Returns:
+ * 		Node* - Pointer to the Node in nc, or NULL if not found
+ */
+Node* NodeCollection_findByID(NodeCollection* nc, uint32_t nodeID);
+
+/*
+ * Insert a Node into a NodeCollection, or update the Node with the same ID
+ * 	Arguments:
+ * 		nc	- Pointer to NodeCollection to insert into
+ * 		n	- Pointer to Node to insert (copied)
+ * 	Returns:
+ * 		int - 1 if n was inserted or replaced an older Node, 0 if n was ignored
+ *
+ * 	An existing Node is only replaced if n has a newer time stamp. New Nodes are
+ * 	appended to the end of nc, and ignored if nc is full.
+ */
+int NodeCollection_upsert(NodeCollection* nc, const Node* n);
+
+/*
+ * Merge a NodeCollection into another by upserting every Node
+ * 	Arguments:
+ * 		a	- Pointer to NodeCollection to merge into
+ * 		b	- Pointer to NodeCollection to merge from
+ * 	    ignoreNodeId - NodeID to ignore from b. Only used if > 0.
+ * 	Returns:
+ * 		int - Amount of Nodes in b which were inserted into or updated in a
+ *
+ * 	Equivalent to NodeCollection_append() followed by NodeCollection_removeDuplicateNodes(),
+ * 	but runs in O(b->nodeCount) using the nodeID index of a.
+ */
+int NodeCollection_merge(NodeCollection* a, NodeCollection* b, uint32_t ignoreNodeId);
+
+/*
+ * Merge a NodeCollection into another that is sorted by timestamp, keeping it sorted
+ * 	Arguments:
+ * 		a	- Pointer to NodeCollection to merge into. Must be sorted by timestamp (high to low)
+ * 		b	- Pointer to NodeCollection to merge from. Not changed
+ * 	    ignoreNodeId - NodeID to ignore from b. Only used if > 0.
+ * 		limit	- Max amount of Nodes to keep in a
+ * 		delta	- Pointer to NodeCollection to append the Nodes in b which were inserted into
+ * 				  or updated in a to, or NULL. Should have room for b->nodeCount Nodes
+ * 	Returns:
+ * 		int - Amount of Nodes in b which were inserted into or updated in a
+ *
+ * 	Equivalent to NodeCollection_merge(), NodeCollection_sortByTimeStamp() and
+ * 	NodeCollection_removeExcessNodes(limit), but only sorts b and merges the two in one
+ * 	pass, newest first, in O(a->nodeCount + b->nodeCount log b->nodeCount).
+ */
+int NodeCollection_mergeByTimeStamp(NodeCollection* a, NodeCollection* b, uint32_t ignoreNodeId, unsigned int limit, NodeCollection* delta);
+
 /*
  * Removes excess Nodes from a NodeCollection
  * 	Arguments:
@@ -284,6 +579,11 @@ int NodeCollection_removeExcessNodes(NodeCollection* nc, unsigned int floor);
  *		expire_time	- Age-limit of expired Nodes (EPOCH time)
  *	Returns:
  *		int - amount of removed expired Nodes
+ *
+ *	The remaining Nodes keep their order.
+ *	After the first call, the NodeCollection keeps a heap of time stamps so that later calls
+ *	only touch the Nodes if something has expired. Nodes added to nc other than through
+ *	NodeCollection_upsert(), _merge(), _mergeByTimeStamp() or _append() are not seen by it.
  */
 int NodeCollection_removeExpiredNodes(NodeCollection* nc, unsigned int expire_time);
 
@@ -297,12 +597,29 @@ int NodeCollection_removeExpiredNodes(NodeCollection* nc, unsigned int expire_ti
  */
 NodeCollection* NodeCollection_getCandidateNodes(NodeCollection* nc);
 
+/*
+ * Get a NodeCollection of candidate nodes with respect to a Node, using the spatial grid
+ * 	Arguments:
+ * 		nc	- Pointer to source NodeCollection
+ * 		n	- Pointer to Node to find candidates for (typically our own Node)
+ * 	Returns:
+ * 		Pointer to NodeCollection of candidate nodes, with utility calculated with respect to n
+ * 	Note: The NodeCollection is malloced, use NodeCollection_destroy() to free memory properly
+ *
+ * 	Only the grid cells within the coordination range of n plus the largest coordination
+ * 	range in nc are visited. The grid is rebuilt first if nc has changed since last call.
+ */
+NodeCollection* NodeCollection_getCandidateNodesNear(NodeCollection* nc, Node* n);
+
 /*
  * Get a random important node from a NodeCollection
  * 	Arguments:
- * 		nc	- Pointer to NodeCollection
+ * 		nc	- Pointer to NodeCollection, sorted by utility
  * 	Returns:
- * 		Node* - Pointer to a Node
+ * 		Node* - Pointer to a Node, or NULL if there is no Node to choose (other than our own)
+ *
+ * 	The Node is chosen among the candidate nodes (or the top of the list if there are few),
+ * 	with recently updated Nodes more likely to be chosen, see NODE_SAMPLER_AGE_SCALE.
  */
 Node* Node_getRandomImportantNode(NodeCollection* nc);
 
@@ -311,7 +628,9 @@ Node* Node_getRandomImportantNode(NodeCollection* nc);
  * 	Arguments:
  * 		nc	- Pointer to NodeCollection
  * 	Returns:
- * 		Node* - Pointer to randomly chosen Node
+ * 		Node* - Pointer to randomly chosen Node, or NULL if there is no Node to choose (other than our own)
+ *
+ * 	Recently updated Nodes are more likely to be chosen, see NODE_SAMPLER_AGE_SCALE.
  */
 Node* Node_getRandomPeerNode(NodeCollection* nc);
 
@@ -322,6 +641,15 @@ Node* Node_getRandomPeerNode(NodeCollection* nc);
  * 		b	- Pointer to node b
  * 	Returns:
  * 		double	- Utility of node b with respect to node a
+ *
+ * 	Uses the cached unit vectors of a and b, see Node_setPosition(). The distance is
+ * 	within GEO_CHORD_ERROR metres of geo_distance_meters(). Utilities within
+ * 	GEO_UTILITY_BAND of 1 are recomputed with geo_distance_meters(), so which Nodes are
+ * 	candidates (utility >= 1) is the same as with it.
+ *
+ * 	When built with P2PDPRD_FIXED_POINT, the fixed-point positions are used instead and
+ * 	whether utility >= 1 is decided with integer arithmetic, see geo_fixed_utility().
+ * 	The distance is then within GEO_FIXED_ABS_ERROR and GEO_FIXED_REL_ERROR.
  */
 double Node_utility(Node* a, Node* b);
 
@@ -345,13 +673,18 @@ int NodeCollection_countCandidateNodes(NodeCollection* in);
 void NodeCollection_calculateUtility(NodeCollection* nc, Node* n);
 
 /*
- * Send a NodeCollection to a peer Node
+ * Calculate the utility of the Nodes in a NodeCollection that are not up to date
  * 	Arguments:
- * 		nc			- Pointer to NodeCollection to send
- *		peerNode	- Pointer to Node object of peer to send to
- *	Returns:
- *		int - Amount of sent bytes
+ * 		nc		- Pointer to NodeCollection
+ * 		n		- Pointer to Node to calculate the utility with respect to (our own Node)
+ * 		epoch	- Position epoch of n (see Config.CLIENT_positionEpoch), > 0
+ * 		cache	- Pointer to NodeCollection to reuse utilities from, or NULL
+ * 	Returns:
+ * 		int		- Amount of Nodes whose utility was calculated
+ *
+ * 	Only Nodes with a utilityEpoch other than epoch are updated. A Node found in cache with the same
+ * 	position and coordination range, and an up to date utility, gets its utility from there.
  */
-int NodeCollection_sendToPeer(NodeCollection* nc, Node* peerNode);
+int NodeCollection_refreshUtility(NodeCollection* nc, Node* n, uint32_t epoch, NodeCollection* cache);
 
 #endif /* INCLUDE_NODE_H_ */
@@ -49,6 +49,16 @@
 
 int RUNNING = 1;		/* Flag to determine run-status, 0 or 1 */
 
+#define EVENT_ARENA_SIZE (64 * 1024)	/* Initial size of the event Arena, it grows to fit the largest event */
+#define LOCAL_REQUEST_POOL_SIZE 2		/* LocalRequests in use at once */
+
+/* Returns a monotonic time stamp in microseconds, for timing events */
+static double event_clock_us(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
 /* Function to initiate graceful shutdown on SIGTERM */
 void terminate(){
 	log_event(LOG_DEBUG, "TEST: Received signal to shut down, exiting program...\n");
@@ -63,8 +73,8 @@ int main(int argc, char* argv[]){
 	signal(SIGTERM, terminate);
 	signal(SIGINT, terminate);
 
-    /* Seed random generator (ONCE) - we should by all means use a better seed, by the way */
-	srand(time(NULL));
+    /* Seed random generator (ONCE) from the system */
+	random_seed(0);
 
 	/* ---------- Set up and handle configuration ---------- */
 	CONFIG = Config_new();					/* Allocate global Config CONFIG */
@@ -76,11 +86,24 @@ int main(int argc, char* argv[]){
 	/* ---------- Initialise data structures in memory ---------- */
 	NodeCollection* importantNodes 	= NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, (CONFIG->PROTO_M + CONFIG->PROTO_K));
 	NodeCollection* randomNodes		= NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, (CONFIG->PROTO_N * 2));
+	/* Large tables are scored and sorted on a pool of threads, if configured */
+	WorkerPool* workers = CONFIG->PROTO_workers > 1 ? WorkerPool_new(CONFIG->PROTO_workers) : NULL;
+	NodeCollection_setWorkers(importantNodes, workers);
+	NodeCollection_setWorkers(randomNodes, workers);
+	if(CONFIG->PROTO_memoryBudget){
+		/* Allocate everything up front, importantNodes gets what is left of the budget */
+		Protocol_preallocate(importantNodes, randomNodes, (size_t)CONFIG->PROTO_memoryBudget * 1024);
+	} else {
+		/* importantNodes grows with the number of candidates, let it do so in place */
+		NodeCollection_reserve(importantNodes, P2PDPRD_NODES_MAX_SIZE);
+	}
 
-	/* Allocate subscriber list */
+	/* Allocate subscriber list. One pooled Subscriber more, for looking up one to remove */
 	SubscriberList* subs = SubscriberList_new(MAX_NUM_SUBSCRIBERS);
+	Subscriber_initPool(MAX_NUM_SUBSCRIBERS + 1);
+	LocalRequest_initPool(LOCAL_REQUEST_POOL_SIZE);
 	/* Allocate local socket recieve buffer */
-	unsigned char* local_sock_buf = (unsigned char*) malloc(LOCAL_SOCK_BUF_SIZE);
+	unsigned char* local_sock_buf = (unsigned char*) mem_alloc(LOCAL_SOCK_BUF_SIZE);
 
 
 	/* ---------- Initialise I/O and message handling ---------- */
@@ -94,6 +117,8 @@ int main(int argc, char* argv[]){
 
 	/* Set up network socket. A FD to the socket is returned if successful. */
 	int networkSock = IO_recvSocket_init(CONFIG->NETWORK_port);
+	/* Which is where everything is sent from too, so that peers see the port we listen on */
+	IO_setSendSocket(networkSock);
 	/* Set up local listening socket. A FD to the socket is returned if successful. */
 	int localSock = LocalIO_localSocket_init(CONFIG->LOCAL_socketPath);
 
@@ -120,6 +145,15 @@ int main(int argc, char* argv[]){
 
     long last_cleanup_timestamp = time(NULL);
 
+	/* Temporaries made while handling an event (see mem_new()) come from this Arena.
+	 * It is reset at the end of every pass through the main loop */
+	Arena* eventArena = Arena_new(EVENT_ARENA_SIZE);
+	mem_setArena(eventArena);
+
+	/* Events handled, heap allocations and time spent handling them, since the last cleanup */
+	unsigned long events = 0, eventAllocations = 0;
+	double eventTime = 0;
+
 	/* ---------- Start main loop ---------- */
 	while(RUNNING){
 		varSet = initSet;	/* The varSet fd-set is changed by the system upon return of select().
@@ -134,17 +168,20 @@ int main(int argc, char* argv[]){
 				&varTime		/* Update time to timeout in varTime */
 		);
 		/* Select has returned. Check what event caused it. */
+		double eventStart = event_clock_us();
+		unsigned long allocations = mem_allocations();
+		int handled = selectState > 0;	/* Set if there was anything to do */
 
 		if(selectState < 0 && RUNNING){
 			/* There was an error during call to select() */
 			log_event(LOG_ERROR, "Select() returned error %d: %s", largestSock, errno, strerror(errno));
 			varTime = initTime;
-			varTime.tv_usec = (time_t) rand() % CONFIG->PROTO_timeout_variation; /* Add random interval to timeout */
+			varTime.tv_usec = (time_t) random_below(CONFIG->PROTO_timeout_variation); /* Add random interval to timeout */
 
 		} else if (selectState == 0){
 			/* Reset timer */
 			varTime = initTime;
-			varTime.tv_usec = (time_t) rand() % CONFIG->PROTO_timeout_variation; /* Add random interval to timeout */
+			varTime.tv_usec = (time_t) random_below(CONFIG->PROTO_timeout_variation); /* Add random interval to timeout */
 	
 		} else if(selectState > 0){
 			/* select() returned on socket activity */
@@ -183,27 +220,45 @@ int main(int argc, char* argv[]){
 
         if (time(NULL) - last_cleanup_timestamp > CONFIG->PROTO_timeout) {
             log_event(LOG_DEBUG,"Performing periodic cleanup.");
+            if(events > 0){
+                log_event(LOG_DEBUG, "Handled %lu events, %.2f heap allocations and %.1f us per event",
+                        events, (double)eventAllocations / events, eventTime / events);
+                events = eventAllocations = 0;
+                eventTime = 0;
+            }
+            log_event(LOG_DEBUG, "%lu pages sent, %lu received", Protocol_pagesSent(), Protocol_pagesReceived());
+            log_event(LOG_DEBUG, "%lu tables sent from the page cache, %lu packed", Protocol_cacheHits(), Protocol_cacheMisses());
 
             /* This used to be called when select() returned on a timeout, but is now called periodically */
             Protocol_timeout(randomNodes, importantNodes);
 
             /* TEMPORARY TEST */
-            NodeCollection* cn = NodeCollection_getCandidateNodes(importantNodes);
+            /* Create own Node */
+            Node* ownNode = Node_createOwnNode();
+            NodeCollection* cn = NodeCollection_getCandidateNodesNear(importantNodes, ownNode);
             printf("Found %d candidate nodes...\n", cn->nodeCount);
             if (subs->num_subs > 0){
-                /* Create own Node */
-                Node* ownNode = Node_createOwnNode();
                 int cand_bytes_total = LocalIO_sendCandidateNodes(cn, subs, ownNode);
                 log_event(LOG_DEBUG, "Sent %d bytes to %d subscribers\n", cand_bytes_total, subs->num_subs);
-                Node_destroy(ownNode);
             }
 
+            Node_destroy(ownNode);
             NodeCollection_destroy(cn);
             /* TEST END */
 
             last_cleanup_timestamp = time(NULL);
+            handled = 1;
+        }
+
+        /* Everything made with mem_new() while handling the event is gone after this */
+        Arena_reset(eventArena);
+        if(handled){
+            events++;
+            eventAllocations += mem_allocations() - allocations;
+            eventTime += event_clock_us() - eventStart;
         }
 	}
+	mem_setArena(NULL);
 
 	/* ---------- Clean up ---------- */
 
@@ -214,7 +269,11 @@ int main(int argc, char* argv[]){
 	/* Free allocated memory */
 	NodeCollection_destroy(importantNodes);
 	NodeCollection_destroy(randomNodes);
+	WorkerPool_destroy(workers);
 	SubscriberList_destroy(subs);
+	Subscriber_freePool();
+	LocalRequest_freePool();
+	Arena_destroy(eventArena);
 	free(local_sock_buf);
 
 	/* Unlink local listening socket from local socket path */
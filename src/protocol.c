@@ -38,16 +38,313 @@
 
 #include "protocol.h"
 
+/* Our own Node as of the last timeout, which utility is calculated with respect to,
+ * and the position epoch (CONFIG->CLIENT_positionEpoch) it has. Not made with Node_new(),
+ * as it is first needed while handling an event, and outlives it */
+static Node scoringNodeStorage;
+static Node* scoringNode = NULL;
+static uint32_t scoringEpoch = 0;
+
+/* Buffers and NodeCollections reused for every packet, see Protocol_preallocate().
+ * NULL unless preallocated, everything is allocated per packet then. */
+static unsigned char* recvBuffer = NULL;
+static NodeCollection* recvNodes = NULL;	/* Received NodeCollection */
+static NodeCollection* deltaNodes = NULL;	/* See Protocol_updateFromRandomNodes() */
+static unsigned char* sendBuffer = NULL;	/* Nodes of the page being sent, see Protocol_sendNodes() */
+static int sendBufferSize = 0;
+
+/* Heap allocations made while handling packets and timeouts, see Protocol_allocations() */
+static unsigned long protocolAllocations = 0;
+
+/* Datagrams sent and NodeCollections received, see Protocol_pagesSent() */
+static unsigned long pagesSent = 0;
+static unsigned long pagesReceived = 0;
+
+/* The pages a table was last sent in, packed in one wire format, see Protocol_sendNodes(). Reused
+ * as long as the table is at the same version, after the same record of our own Node (v3 codes
+ * the first Node of the table against it) and, for v2 and v3, in the same second (their records
+ * hold ages, v1 records absolute time stamps) */
+typedef struct PageCache {
+	const NodeCollection*	table;		/* NULL if not in use */
+	uint32_t				version;	/* table->version the pages were packed from */
+	int						valid;
+	int						count;		/* Nodes packed */
+	int						pageSize;
+	uint32_t				now;
+	int						headSize;	/* Header and our own Node */
+	NodeDeltaRef			ref;
+	int						pages;
+	int*					pageEnd;	/* Offset in buff of the end of each page */
+	uint16_t*				pageNodes;	/* Nodes of the table on each page */
+	unsigned char*			buff;
+	int						maxNodes;	/* Room for as many Nodes, and pages */
+} PageCache;
+
+/* Smallest page: the header and two Nodes, the sender and one more, in the longest records of
+ * any wire format */
+#define PROTO_MIN_PAGE_SIZE		(NC_HEADER_OFFSET + 2 * NODE_MAX_OFFSET)
+
+/* One PageCache for randomNodes and one for importantNodes, in each wire format */
+#define PROTO_CACHE_RANDOM		0
+#define PROTO_CACHE_IMPORTANT	1
+#define PROTO_CACHED_TABLES		2
+static PageCache pageCaches[PROTO_CACHED_TABLES][P2PDPRD_VERSION_ID_V3];
+
+/* Sends served from and not from pageCaches, see Protocol_cacheHits() */
+static unsigned long cacheHits = 0;
+static unsigned long cacheMisses = 0;
+
+static void Protocol_selectImportantNodes(NodeCollection* in);
+
+/* Returns scoringNode, updated to the current position if update is set */
+static Node* Protocol_scoringNode(int update){
+	if(!scoringNode){
+		/* Only used for internal calculation -> No need for networking vars */
+		scoringNode = &scoringNodeStorage;
+		memset(scoringNode, 0, sizeof(Node));
+		scoringNode->nodeID = CONFIG->CLIENT_id;
+		Node_setPosition(scoringNode, CONFIG->CLIENT_lat, CONFIG->CLIENT_lon);
+		scoringNode->coordRange = CONFIG->CLIENT_coordRange;
+		scoringEpoch = CONFIG->CLIENT_positionEpoch;
+	} else if(update && scoringEpoch != CONFIG->CLIENT_positionEpoch){
+		Node_setPosition(scoringNode, CONFIG->CLIENT_lat, CONFIG->CLIENT_lon);
+		scoringNode->coordRange = CONFIG->CLIENT_coordRange;
+		scoringEpoch = CONFIG->CLIENT_positionEpoch;
+	}
+	return scoringNode;
+}
+
+/* Bytes taken by a PageCache with room for maxNodes Nodes */
+static size_t Protocol_pageCacheFootprint(int maxNodes){
+	return (size_t)maxNodes * NODE_MAX_OFFSET + (size_t)(maxNodes + 1) * (sizeof(int) + sizeof(uint16_t));
+}
+
+/* Makes room in cache for maxNodes Nodes, throwing away what it holds if it has to grow. Leaves
+ * it as it is for no Nodes (mem_realloc() to 0 bytes may free or not) */
+static void Protocol_pageCacheReserve(PageCache* cache, int maxNodes){
+	if(maxNodes <= 0 || (cache->pageEnd && maxNodes <= cache->maxNodes)){
+		return;
+	}
+	cache->buff = mem_realloc(cache->buff, (size_t)maxNodes * NODE_MAX_OFFSET);
+	cache->pageEnd = mem_realloc(cache->pageEnd, (maxNodes + 1) * sizeof(int));
+	cache->pageNodes = mem_realloc(cache->pageNodes, (maxNodes + 1) * sizeof(uint16_t));
+	cache->maxNodes = maxNodes;
+	cache->valid = 0;
+}
+
+/* The budget is spent on the fixed-size parts first. importantNodes gets the rest */
+uint32_t Protocol_preallocate(NodeCollection* in, NodeCollection* rn, size_t budget){
+	size_t fixed = MAX_PAYLOAD_BYTESIZE
+			+ 2 * (sizeof(NodeCollection) + NC_MAX_PACKET_NODES * sizeof(Node))
+			+ Protocol_pageSize()
+			+ CONFIG->PROTO_wireVersion * (Protocol_pageCacheFootprint(rn->maxNodeCount)
+					+ Protocol_pageCacheFootprint(CONFIG->PROTO_K))
+			+ NodeCollection_footprint(rn->maxNodeCount);
+
+	/* Largest importantNodes that fits */
+	uint32_t lo = in->maxNodeCount, hi = P2PDPRD_NODES_MAX_SIZE;
+	if(fixed + NodeCollection_footprint(lo) > budget){
+		log_event(LOG_ERROR, "Memory budget of %lu kB is too small for the configured table sizes, using %lu kB",
+				(unsigned long)(budget / 1024),
+				(unsigned long)((fixed + NodeCollection_footprint(lo)) / 1024));
+		hi = lo;
+	}
+	while(lo < hi){
+		uint32_t mid = lo + (hi - lo + 1) / 2;
+		if(fixed + NodeCollection_footprint(mid) <= budget)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	NodeCollection_preallocate(rn, rn->maxNodeCount);
+	NodeCollection_preallocate(in, lo);
+
+	recvBuffer = mem_alloc(MAX_PAYLOAD_BYTESIZE);
+	recvNodes = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, NC_MAX_PACKET_NODES);
+	deltaNodes = NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, NC_MAX_PACKET_NODES);
+	sendBufferSize = Protocol_pageSize();
+	sendBuffer = mem_alloc(sendBufferSize);
+	int format;
+	for(format = P2PDPRD_VERSION_ID ; format <= CONFIG->PROTO_wireVersion ; format++){
+		Protocol_pageCacheReserve(&pageCaches[PROTO_CACHE_RANDOM][format - 1], rn->maxNodeCount);
+		Protocol_pageCacheReserve(&pageCaches[PROTO_CACHE_IMPORTANT][format - 1], CONFIG->PROTO_K);
+	}
+	Protocol_scoringNode(0);
+
+	log_event(LOG_DEBUG, "Preallocated %lu kB, room for %d important nodes",
+			(unsigned long)((fixed + NodeCollection_footprint(lo)) / 1024), lo);
+	return lo;
+}
+
+unsigned long Protocol_allocations(){
+	return protocolAllocations;
+}
+
+int Protocol_pageSize(){
+	int size = CONFIG->NETWORK_pathMTU - UDP_IP_HEADER_BYTESIZE;
+	if(CONFIG->NETWORK_pathMTU == 0 || size > MAX_PAYLOAD_BYTESIZE){
+		return MAX_PAYLOAD_BYTESIZE;
+	}
+	return size < PROTO_MIN_PAGE_SIZE ? PROTO_MIN_PAGE_SIZE : size;
+}
+
+unsigned long Protocol_pagesSent(){
+	return pagesSent;
+}
+
+unsigned long Protocol_pagesReceived(){
+	return pagesReceived;
+}
+
+unsigned long Protocol_cacheHits(){
+	return cacheHits;
+}
+
+unsigned long Protocol_cacheMisses(){
+	return cacheMisses;
+}
+
+/* Frees nc unless it is one of the preallocated NodeCollections */
+static void Protocol_releaseNodes(NodeCollection* nc){
+	if(nc != deltaNodes && nc != recvNodes){
+		NodeCollection_destroy(nc);
+	}
+}
+
+/* PageCache number slot, for table in the given format, with room for count Nodes. NULL if there
+ * is no room and the caches are preallocated: they are not grown while handling events then.
+ * NULL too for an empty table the cache was never reserved for */
+static PageCache* Protocol_pageCache(int slot, const NodeCollection* table, int format, int count){
+	PageCache* cache = &pageCaches[slot][format - 1];
+	if(cache->table != table){
+		cache->table = table;
+		cache->valid = 0;
+	}
+	if(count > cache->maxNodes || !cache->pageEnd){
+		if(sendBuffer){
+			return NULL;
+		}
+		Protocol_pageCacheReserve(cache, count);
+		if(!cache->pageEnd){
+			return NULL;
+		}
+	}
+	return cache;
+}
+
+/* Whether cache holds the Nodes of table that would go after the header and our own Node of page */
+static int Protocol_pageCacheHit(const PageCache* cache, const NodeCollection* table, const NodePage* page,
+		int count, int pageSize){
+	return cache->valid && cache->version == table->version && cache->count == count &&
+			cache->pageSize == pageSize && cache->headSize == page->headSize &&
+			(page->format == P2PDPRD_VERSION_ID || cache->now == page->now) &&
+			memcmp(&cache->ref, &page->ref, sizeof(NodeDeltaRef)) == 0;
+}
+
+/* Sends our own Node and count Nodes of table (in the order of order, unless NULL) to peerNode,
+ * in the highest wire format both accept, one page (see Protocol_pageSize()) at a time. Only the
+ * first page asks for a reply. The Nodes are packed straight from the table, and sent after the
+ * header and our own Node (on the stack). They are packed to PageCache number cached if it is 0
+ * or more, and sent from there as long as the table does not change, else to sendBuffer */
+static void Protocol_sendNodes(payloadType type, const NodeCollection* table, const int* order, int count,
+		int cached, Node* peerNode){
+	int format = peerNode->wireVersion < CONFIG->PROTO_wireVersion ? peerNode->wireVersion : CONFIG->PROTO_wireVersion;
+	if(format < P2PDPRD_VERSION_ID){
+		format = P2PDPRD_VERSION_ID;
+	}
+	uint16_t versionID = NC_VERSION(format, CONFIG->PROTO_wireVersion);
+
+	Node ownNode;
+	memset(&ownNode, 0, sizeof(Node));
+	Node_initOwnNode(&ownNode);
+
+	NodePage page;
+	if(NodePage_begin(&page, versionID, type, &ownNode) == 0){
+		return;
+	}
+	int pageSize = Protocol_pageSize();
+	int room = pageSize - page.headSize;
+	const Node* nodes = table ? table->nodes : NULL;
+
+	PageCache* cache = table && cached >= 0 ? Protocol_pageCache(cached, table, format, count) : NULL;
+	int hit = cache && Protocol_pageCacheHit(cache, table, &page, count, pageSize);
+	unsigned char* buffer = NULL;
+	if(hit){
+		cacheHits++;
+	} else if(cache){
+		cacheMisses++;
+		cache->valid = 0;
+		cache->pages = 0;
+	} else {
+		buffer = sendBuffer ? sendBuffer : mem_new(pageSize);
+	}
+
+	struct iovec iov[2];
+	int next = 0, pages = 0, offset = 0;
+	do {
+		iov[0].iov_base = page.head;
+		iov[0].iov_len = page.headSize;
+		if(hit){
+			NodePage_setHeader(&page, type, cache->pageNodes[pages] + 1);
+			iov[1].iov_base = cache->buff + offset;
+			iov[1].iov_len = cache->pageEnd[pages] - offset;
+			offset = cache->pageEnd[pages];
+		} else {
+			/* The cache has room for count Nodes of any size, so the pages always fit */
+			unsigned char* out = cache ? cache->buff + offset : buffer;
+			int first = next;
+			NodePage_setHeader(&page, type, 1);
+			iov[1].iov_base = out;
+			iov[1].iov_len = NodePage_fill(&page, nodes, order, count, &next, out, room);
+			if(iov[1].iov_len == 0 && next < count){
+				log_event(LOG_ERROR, "Page size %d is too small to send a Node on", pageSize);
+				break;
+			}
+			if(cache){
+				offset += iov[1].iov_len;
+				cache->pageEnd[pages] = offset;
+				cache->pageNodes[pages] = next - first;
+				cache->pages = pages + 1;
+			}
+		}
+		IO_sendVector(iov, 2, peerNode->ipAddr, peerNode->port);
+		pagesSent++;
+		pages++;
+
+		if(type == RND_REQ){
+			type = RND_NOREQ;
+		} else if(type == IMP_REQ){
+			type = IMP_NOREQ;
+		}
+	} while(hit ? pages < cache->pages : next < count);
+
+	if(cache && !hit && next >= count){
+		cache->version = table->version;
+		cache->count = count;
+		cache->pageSize = pageSize;
+		cache->now = page.now;
+		cache->headSize = page.headSize;
+		cache->ref = page.ref;
+		cache->valid = 1;
+	}
+	if(buffer && buffer != sendBuffer){
+		mem_free(buffer);
+	}
+}
+
 void Protocol_timeout(NodeCollection* rn, NodeCollection* in){
 	/* 1. remove old nodes from randomNodes
 	 * 2. remove old nodes from importantNodes
-	 * 3. sort ImportantNodes depending on utility
+	 * 3. recalculate utility of importantNodes if our position has changed, and sort
 	 * 4. get random peer Node from randomNodes
 	 * 5. send randomNodes to randomPeerNode -> Type = RND_REQ
 	 * 6. get random peer Node from importantNodes
 	 * 7. send importantNodes to importantPeerNode -> TYPE = IMP_REQ
 	 */
 
+	unsigned long allocations = mem_allocations();
+
 	/* Remove old nodes from randomNodes and importantNodes.
 	 * sort importantNodes to return it to its origanl state */
 	int removed_nodes = 0;
@@ -61,7 +358,13 @@ void Protocol_timeout(NodeCollection* rn, NodeCollection* in){
 		log_event(LOG_DEBUG, "%d nodes in importantNodes met the age limit and were discarded", removed_nodes);
 	}
 
-	NodeCollection_sortByUtility(in);
+	/* importantNodes is kept sorted, unless utility has changed */
+	Node* ownNode = Protocol_scoringNode(1);
+	int rescored = NodeCollection_refreshUtility(in, ownNode, scoringEpoch, NULL);
+	if(rescored > 0){
+		log_event(LOG_DEBUG, "Recalculated utility of %d nodes in importantNodes", rescored);
+		NodeCollection_sortByUtility(in);
+	}
 
 	/* Get a random peerNode and send randomNodes to this peer */
 	Node* peerNode = Node_getRandomPeerNode(rn);
@@ -80,30 +383,72 @@ void Protocol_timeout(NodeCollection* rn, NodeCollection* in){
 		Protocol_sendImportantNodes(in, IMP_REQ, peerNode);
 		log_event(LOG_DEBUG, "Sent importantNodes to peer %d\n", peerNode->nodeID);
 	}
+
+	protocolAllocations += mem_allocations() - allocations;
 }
 /* Run-once function to send own Node object to the origin peer.
  * Only used on startup of program.
  */
 void Protocol_bootstrap(uint32_t originPeerIP, uint16_t originPeerPort){
-	/* Create own node */
-	Node* ownNode = Node_createOwnNode();
+	/* Peer node, only the address is known */
+	Node peerNode;
+	memset(&peerNode, 0, sizeof(Node));
+	peerNode.ipAddr = originPeerIP;
+	peerNode.port = originPeerPort;
+
+	/* Send empty randomNodes, with just ownNode on top */
+	Protocol_sendNodes(RND_REQ, NULL, NULL, 0, -1, &peerNode);
+}
 
-	/* Create peer node */
-	Node* peerNode = Node_new(0, 0, 0, 0, originPeerIP, originPeerPort, 0, 0, time(NULL));
+/* Updates randomNodes (rn) with received random nodes nc, and importantNodes (in) with those
+ * of them that were new or newer to rn. Most of the time there are none, and in is left alone. */
+static void Protocol_updateFromRandomNodes(NodeCollection* nc, NodeCollection* rn, NodeCollection* in){
+	NodeCollection* delta = deltaNodes ? deltaNodes : NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, nc->nodeCount);
+	delta->nodeCount = 0;
 
-	/*
-	 * 1. Create empty randomNodes with ownNode on top.
-	 * 2. Send to peerNode
-	 */
-	NodeCollection* nc = NodeCollection_new(P2PDPRD_VERSION_ID, RND_REQ, 1);
-	memcpy(&nc->nodes[0], ownNode, sizeof(Node));
-	nc->nodeCount = 1;
+	int changed = Protocol_updateRandomNodes(nc, rn, delta);
+	log_event(LOG_DEBUG, "Updated randomNodes using NodeCollection from peer %d, %d nodes new or newer", nc->nodes[0].nodeID, changed);
+
+	if(changed > 0){
+		Protocol_updateImportantNodes(delta, in);
+		log_event(LOG_DEBUG, "Updated importantNodes\n");
+	}
+
+	Protocol_releaseNodes(delta);
+}
 
-	NodeCollection_sendToPeer(nc, peerNode);
+/* Merges the important nodes of packet into in, straight from the view. Like
+ * Protocol_updateImportantNodes(), but Nodes that in already has at least as recent are skipped
+ * before their utility is calculated. packet must have passed NodePacket_validate(), so that it
+ * is merged whole or not at all. Returns the number of Nodes merged */
+static int Protocol_updateImportantNodesFromPacket(const NodePacket* packet, NodeCollection* in){
+	Node* ownNode = Protocol_scoringNode(0);
+	NodePacketReader reader;
+	Node n;
+	int merged = 0;
+
+	NodePacket_begin(packet, &reader);
+	while(NodePacket_next(&reader, &n) > 0){
+		if(n.nodeID == CONFIG->CLIENT_id){
+			continue;
+		}
+		Node* c = NodeCollection_findByID(in, n.nodeID);
+		if(c && c->timeStamp >= n.timeStamp){
+			continue;	/* NodeCollection_upsert() would keep c */
+		}
+		if(c && c->utilityEpoch == scoringEpoch && Node_lat(c) == Node_lat(&n) && Node_lon(c) == Node_lon(&n) && c->coordRange == n.coordRange){
+			n.utility = c->utility;
+		} else {
+			n.utility = Node_utility(ownNode, &n);
+		}
+		n.utilityEpoch = scoringEpoch;
+		merged += NodeCollection_upsert(in, &n);
+	}
 
-	Node_destroy(peerNode);
-	Node_destroy(ownNode);
-	NodeCollection_destroy(nc);
+	if(merged > 0){
+		Protocol_selectImportantNodes(in);
+	}
+	return merged;
 }
 
 void Protocol_receiveFromPeer(int sock, NodeCollection* importantNodes, NodeCollection* randomNodes){
@@ -111,220 +456,149 @@ void Protocol_receiveFromPeer(int sock, NodeCollection* importantNodes, NodeColl
 	 * To handle this event, we take the following sequence of actions:
 	 * 1. Run subroutine to determine size of UDP payload
 	 * 2. Receive payload, store to byte buffer
-	 * 3. Deserialize payload, convert to NodeCollection
-	 * 4. Examine received NodeCollection, handle appropriately
+	 * 3. Check the header of the payload, and read the Node of the sender
+	 * 4. Merge the Nodes of the payload, and reply to the sender if asked to
 	 */
 
 	/* Control variables */
-	int numNodes;													/* Number of nodes in received NodeCollection */
 	int payloadSize;												/* Bytesize of received payload */
 	struct sockaddr_in from_addr;									/* Packet source address */
 	unsigned int from_addr_len = sizeof(struct sockaddr_in);		/* Variable to store length of packet source address */
+	NodePacket packet;												/* View of the payload */
+	NodePacketReader reader;
+	Node sender;													/* First Node of the payload */
+
+	unsigned long allocations = mem_allocations();
 
-	/* Set up the byte buffer */
-	unsigned char* buffer = malloc(MAX_PAYLOAD_BYTESIZE);
+	/* The byte buffer is allocated once, and reused for every packet */
+	if(!recvBuffer){
+		recvBuffer = mem_alloc(MAX_PAYLOAD_BYTESIZE);
+	}
 
 	/* Read data from socket. Returns size of payload in bytes to payloadSize */
 	payloadSize = recvfrom(	sock,							/* Socket to read from */
-							buffer,							/* Buffer to read to */
+							recvBuffer,						/* Buffer to read to */
 							MAX_PAYLOAD_BYTESIZE ,			/* Max size of buffer. If exceeded, data is cut short */
 							0,								/* No flags are set */
 							(struct sockaddr *)&from_addr,	/* Sender sockaddr */
 							&from_addr_len					/* Size of sender addr field */
 	);
 
-	/* Unpack the NodeCollection object from the byte buffer. Number of nodes is returned to numNodes */
-	NodeCollection* nc = NodeCollection_unpack(buffer, payloadSize, &numNodes);
+	/* Reject what is malformed before anything else is done with it */
+	int valid = 0;
+	if(NodePacket_open(&packet, recvBuffer, payloadSize) == 0 && packet.payloadType < INTERNAL){
+		NodePacket_begin(&packet, &reader);
+		valid = NodePacket_next(&reader, &sender) > 0;
+	}
+	if(!valid){
+		/* Received a NodeCollection of non-valid type. Something is wrong, but it is not critical. Discard and log. */
+		log_event(LOG_DEBUG, "Received a non-valid NodeCollection from peer");
+		protocolAllocations += mem_allocations() - allocations;
+		return;
+	}
 
 	/* We have received a NodeCollection from a peer */
-	if(NodeCollection_isValid(nc)){
-		/* Print nodeCollection for debugging: */
-		NodeCollection_print(nc);
-		/* Check type of NodeCollection. Take appropriate action */
-		if	(nc->payloadType == RND_NOREQ){
-			log_event(LOG_DEBUG, "Received NodeCollection of type RND_NOREQ from %d", nc->nodes[0].nodeID);
-
-			Protocol_updateRandomNodes(nc, randomNodes);
-			log_event(LOG_DEBUG, "Updated randomNodes using NodeCollection from peer %d", nc->nodes[0].nodeID);
-
-			Protocol_updateImportantNodes(randomNodes, importantNodes);
-			log_event(LOG_DEBUG, "Updated importantNodes\n");
-
-		} else if (nc->payloadType == RND_REQ){
-			log_event(LOG_DEBUG, "Received NodeCollection of type RND_REQ from %d", nc->nodes[0].nodeID);
-			Protocol_sendRandomNodes(randomNodes, RND_NOREQ, &nc->nodes[0]);
-
-			log_event(LOG_DEBUG, "Sent randomNodes to peer %d", nc->nodes[0].nodeID);
-
-			Protocol_updateRandomNodes(nc, randomNodes);
-			log_event(LOG_DEBUG, "Updated randomNodes using NodeCollection from peer %d", nc->nodes[0].nodeID);
-
-			Protocol_updateImportantNodes(randomNodes, importantNodes);
-			log_event(LOG_DEBUG, "Updated importantNodes\n");
-
-		} else if (nc->payloadType == IMP_NOREQ){
-			log_event(LOG_DEBUG, "Received NodeCollection of type IMP_NOREQ from %d - port %d\n", nc->nodes[0].nodeID, nc->nodes[0].port);
-			Protocol_updateImportantNodes(nc, importantNodes);
-
-			log_event(LOG_DEBUG, "Updated importantNodes using NodeCollection from peer %d - port: %d\n", nc->nodes[0].nodeID, nc->nodes[0].port);
-
-		} else if (nc->payloadType == IMP_REQ){
-			log_event(LOG_DEBUG, "Received NodeCollection of type IMP_REQ from %d", nc->nodes[0].nodeID);
-
-			Protocol_sendImportantNodes(importantNodes, IMP_NOREQ, &nc->nodes[0]);
-			log_event(LOG_DEBUG, "Sent importantNodes to peer %d", nc->nodes[0].nodeID);
-
-			Protocol_updateImportantNodes(nc, importantNodes);
-			log_event(LOG_DEBUG, "Updated importantNodes using NodeCollection from peer %d - port: %d\n", nc->nodes[0].nodeID, nc->nodes[0].port);
+	pagesReceived++;
+	/* Print nodeCollection for debugging: */
+	D(NodePacket_print(&packet));
+
+	/* Check type of NodeCollection. Take appropriate action */
+	if (packet.payloadType == RND_NOREQ || packet.payloadType == RND_REQ){
+		/* The random nodes are merged in timestamp order, so they are decoded first */
+		NodeCollection* nc = recvNodes ? recvNodes : NodeCollection_new(P2PDPRD_VERSION_ID, INTERNAL, packet.nodeCount);
+		if(NodeCollection_unpackTo(recvBuffer, payloadSize, nc) > 0){
+			log_event(LOG_DEBUG, "Received NodeCollection of type %s from %d",
+					packet.payloadType == RND_REQ ? "RND_REQ" : "RND_NOREQ", sender.nodeID);
+			if(packet.payloadType == RND_REQ){
+				Protocol_sendRandomNodes(randomNodes, RND_NOREQ, &sender);
+				log_event(LOG_DEBUG, "Sent randomNodes to peer %d", sender.nodeID);
+			}
+			Protocol_updateFromRandomNodes(nc, randomNodes, importantNodes);
 		} else {
-			log_error(NOTICE, errno, "NodeCollection contained corrupted payload");
+			log_event(LOG_DEBUG, "Received a non-valid NodeCollection from peer %d", sender.nodeID);
 		}
+		Protocol_releaseNodes(nc);
+
+	} else if(NodePacket_validate(&packet) < 0){
+		/* The important nodes are merged as they are read, so a packet cut short is caught first */
+		log_event(LOG_DEBUG, "Received a non-valid NodeCollection from peer %d", sender.nodeID);
+
 	} else {
-		/* Received a NodeCollection of non-valid type. Something is wrong, but it is not critical. Discard and log. */
-		log_event(LOG_DEBUG, "Received a non-valid NodeCollection from peer");
-		//log_event(LOG_DEBUG, "Received a non-valid NodeCollection from peer %d", nc->nodes[0].nodeID);
+		log_event(LOG_DEBUG, "Received NodeCollection of type %s from %d - port %d\n",
+				packet.payloadType == IMP_REQ ? "IMP_REQ" : "IMP_NOREQ", sender.nodeID, sender.port);
+		if(packet.payloadType == IMP_REQ){
+			Protocol_sendImportantNodes(importantNodes, IMP_NOREQ, &sender);
+			log_event(LOG_DEBUG, "Sent importantNodes to peer %d", sender.nodeID);
+		}
+		Protocol_updateImportantNodesFromPacket(&packet, importantNodes);
+		log_event(LOG_DEBUG, "Updated importantNodes using NodeCollection from peer %d - port: %d\n", sender.nodeID, sender.port);
 	}
-	/* Cleaning */
-	free(buffer);
-	NodeCollection_destroy(nc);
 
+	protocolAllocations += mem_allocations() - allocations;
+	if(sendBuffer && mem_allocations() != allocations){
+		log_event(LOG_DEBUG, "%lu allocations while handling a packet", mem_allocations() - allocations);
+	}
 }
-void Protocol_updateRandomNodes(NodeCollection* nc, NodeCollection* rn){
+int Protocol_updateRandomNodes(NodeCollection* nc, NodeCollection* rn, NodeCollection* delta){
 
 	/* Update NodeCollection randomNodes (rn) using received NodeCollection nc
-	 * 1. Append nc to rn
-	 * 2. Null out duplicate Nodes from rn (using timestamp as priority)
-	 * 3. Sort rn by timestamp
-	 * 4. Delete Nodes in rn with index > N (size of rn = 2*N)
+	 * rn is always kept sorted by timestamp (high to low).
+	 * 1. Merge nc into rn (by nodeID, using timestamp as priority), in timestamp order
+	 * 2. Stop when rn holds N Nodes (size of rn = 2*N)
 	 */
 
-	NodeCollection_append(rn, nc, CONFIG->CLIENT_id); // append, but ignore own ID
-	NodeCollection_removeDuplicateNodes(rn);
-	NodeCollection_sortByTimeStamp(rn);
-	NodeCollection_removeExcessNodes(rn, rn->maxNodeCount / 2);
+	return NodeCollection_mergeByTimeStamp(rn, nc, CONFIG->CLIENT_id, rn->maxNodeCount / 2, delta); // merge, but ignore own ID
 }
 void Protocol_updateImportantNodes(NodeCollection* nc, NodeCollection* in){
 	/* Update NodeCollection importantNodes (in) using received NodeCollection nc
-	 * 1. Append nc to rn
-	 * 2. Null out duplicate Nodes from in (using timestamp as priority)
-	 * 3. Calculate utility of nodes in NodeCollection in
-	 * 4. Sort in by utility (high to low)
-	 * 5. Grow if necessary
-	 * 6. Delete Nodes in in with index > M-K (size of in = M+K)
-	 * 7. Deliver updated list to system?
+	 * 1. Calculate utility of nodes in NodeCollection nc that are not up to date
+	 * 2. Merge nc into in (by nodeID, using timestamp as priority)
+	 * 3. Grow if necessary
+	 * 4. Keep the M-K best Nodes of in by utility, sorted high to low (size of in = M+K)
+	 * 5. Deliver updated list to system?
 	 */
 
-	/* Create updated Node-object of ourself*/
-	Node* ownNode = Node_new(CONFIG->CLIENT_id,			/* Only used for internal calculation */
-							 CONFIG->CLIENT_lat,		/* -> No need for networking vars */
-							 CONFIG->CLIENT_lon,
-							 CONFIG->CLIENT_coordRange,
-							 0,
-							 0,
-							 0,
-							 0,
-							 time(NULL)
-	);
+	/* Node-object of ourself as of the last timeout */
+	Node* ownNode = Protocol_scoringNode(0);
 
-	NodeCollection_calculateUtility(nc, ownNode);
-	NodeCollection_append(in, nc, CONFIG->CLIENT_id); // append, but ignore own ID
-	NodeCollection_removeDuplicateNodes(in);
-	NodeCollection_sortByUtility(in);
+	/* Nodes already in in with an up to date utility are not recalculated */
+	NodeCollection_refreshUtility(nc, ownNode, scoringEpoch, in);
+	if(NodeCollection_merge(in, nc, CONFIG->CLIENT_id) == 0){ // merge, but ignore own ID
+		return;	/* Nothing new, in is unchanged */
+	}
 
+	Protocol_selectImportantNodes(in);
+}
+
+/* Steps 3 and 4 of Protocol_updateImportantNodes(), after new Nodes were merged into in */
+static void Protocol_selectImportantNodes(NodeCollection* in){
 	/* Check to see if growing is necessary */
 	int candidate_amount = NodeCollection_countCandidateNodes(in);
-	if(candidate_amount > (in->maxNodeCount - CONFIG->PROTO_K))
+	if(candidate_amount + CONFIG->PROTO_K > in->maxNodeCount)
 		NodeCollection_grow(in, CONFIG->PROTO_K);
 
-	if(in->nodeCount > (in->maxNodeCount - CONFIG->PROTO_K)){
-		NodeCollection_removeExcessNodes(in, (in->maxNodeCount - CONFIG->PROTO_K));
-	}
+	/* Select (and sort) the best nodes, dropping the excess ones */
+	NodeCollection_selectTopK(in, in->maxNodeCount - CONFIG->PROTO_K, ORDER_UTILITY);
 
 	/* Print a message */
 	log_event(LOG_DEBUG, "Counted %d candidate nodes from %d important nodes", candidate_amount, in->nodeCount);
-
-	/* Clean */
-	Node_destroy(ownNode);
 }
 
-/* Sends a NodeCollection of random nodes rn to Node peerNode
- *
- * Main steps taken:
- * 	1. Allocates new NodeCollection nc of size rn.size + 1
- * 	2. Creates Node ownNode
- * 	3. Prepends ownNode to top of nc
- * 	4. Copies contents of rn into nc
- *	5. Sends nc to peerNode
- */
+/* Sends a NodeCollection of random nodes rn to Node peerNode: ownNode on top, followed by the
+ * first rn->nodeCount - 1 Nodes of rn, packed straight from rn */
 void Protocol_sendRandomNodes(NodeCollection* rn, payloadType type, Node* peerNode){
-   /* Create new NodeCollection */
-   NodeCollection* nc = NodeCollection_new(P2PDPRD_VERSION_ID, type, rn->nodeCount + 1);
-
-   /* Create own Node object and stuff on top of nc*/
-   Node* ownNode = Node_createOwnNode();
-   memcpy(&nc->nodes[0], ownNode, sizeof(Node));
-
-   /* Copy Nodes from originalNodeCollection. Nodes[n-1] goes to Nodes[n], leaving the node on the top empty */
-   int j;
-   if(rn->nodeCount > 1){
-	   /* There are more Nodes to carry over than just our own Node object*/
-	   for(j = 1; j < rn->nodeCount ; j++){
-		   memcpy(&nc->nodes[j], &rn->nodes[j-1], sizeof(Node));
-	   }
-	   nc->nodeCount = rn->nodeCount;
-   } else {
-	   /* There is only one Node - ourself */
-	   nc->nodeCount = 1;
-   }
-
-   NodeCollection_sendToPeer(nc, peerNode);
-
-   /* Cleaning */
-   NodeCollection_destroy(nc);
-   Node_destroy(ownNode);
+	Protocol_sendNodes(type, rn, NULL, rn->nodeCount > 1 ? rn->nodeCount - 1 : 0, PROTO_CACHE_RANDOM, peerNode);
 }
 
 /* Sends a NodeCollection of important nodes in to Node peerNode */
 void Protocol_sendImportantNodes(NodeCollection* in, payloadType type, Node* peerNode){
-
-	NodeCollection* tmp_nc = NodeCollection_new(P2PDPRD_VERSION_ID, type, in->nodeCount);
-
-	int l;
-	for(l = 0 ; l < in->nodeCount; l++){
-		memcpy(&tmp_nc->nodes[l], &in->nodes[l], sizeof(Node));
-	}
-	/* Update tmp_nc->nodeCount */
-	tmp_nc->nodeCount = in->nodeCount;
-
-	/* If the list is too large - sort and remove excess nodes based on utility*/
-	if(tmp_nc->nodeCount > CONFIG->PROTO_K){
-		NodeCollection_calculateUtility(tmp_nc, peerNode);			/* Calculate utility of nodes */
-		NodeCollection_sortByUtility(tmp_nc);						/* Sort by newly calculated utility */
-		NodeCollection_removeExcessNodes(tmp_nc, CONFIG->PROTO_K);	/* Remove all excess nodes */
-	}
-
-	/* Create new nc to send to peer */
-	NodeCollection* nc = NodeCollection_new(P2PDPRD_VERSION_ID, type, tmp_nc->nodeCount + 1);
-
-	/* Copy Nodes from originalNodeCollection. Nodes[n-1] goes to Nodes[n], leaving the node on the top empty */
-	int j;
-	for(j = 1; j < tmp_nc->nodeCount + 1 ; j++){
-		memcpy(&nc->nodes[j], &tmp_nc->nodes[j - 1], sizeof(Node));
+	if(in->nodeCount > CONFIG->PROTO_K){
+		/* The list is too large - send only the K best nodes based on utility with respect to the peer */
+		int count;
+		const int* order = NodeCollection_topKFor(in, peerNode, CONFIG->PROTO_K, &count);
+		Protocol_sendNodes(type, in, order, count, -1, peerNode);
+	} else {
+		/* The same for every peer, so it can be sent from the cache */
+		Protocol_sendNodes(type, in, NULL, in->nodeCount, PROTO_CACHE_IMPORTANT, peerNode);
 	}
-	/* Create own Node */
-	Node* ownNode = Node_createOwnNode();
-
-	/* Copy and add own Node object to top */
-	memcpy(&nc->nodes[0], ownNode, sizeof(Node));
-
-	/* Update nodeCount */
-	nc->nodeCount = tmp_nc->nodeCount + 1;
-
-	/* Dispatch to peer */
-	NodeCollection_sendToPeer(nc, peerNode);
-
-	/* Cleaning */
-	NodeCollection_destroy(nc);
-	NodeCollection_destroy(tmp_nc);
-	Node_destroy(ownNode);
 }
@@ -52,17 +52,18 @@
  * Update NodeCollection rn using received NodeCollection nc
  *
  * 	Arguments:
- * 		nc	- Pointer to the received NodeCollection
- * 		rn	- Pointer to the random NodeCollection
+ * 		nc		- Pointer to the received NodeCollection
+ * 		rn		- Pointer to the random NodeCollection
+ * 		delta	- Pointer to NodeCollection to add the Nodes which were new or newer to rn to.
+ * 				  Should have room for nc->nodeCount Nodes
  * 	Returns:
- * 		void
+ * 		int		- Amount of Nodes added to delta
  *
- * 1. Append nc to rn
- * 2. Null out duplicate Nodes from rn (using timestamp as priority)
- * 3. Sort rn by timestamp
- * 4. Delete Nodes in rn with index > N (size of rn = 2*N)
+ * rn is always kept sorted by timestamp (high to low).
+ * 1. Merge nc into rn (by nodeID, using timestamp as priority), in timestamp order
+ * 2. Stop when rn holds N Nodes (size of rn = 2*N)
  */
-void Protocol_updateRandomNodes(NodeCollection* nc, NodeCollection* rn);
+int Protocol_updateRandomNodes(NodeCollection* nc, NodeCollection* rn, NodeCollection* delta);
 
 /* Update NodeCollection importantNodes (in) using received NodeCollection nc
  * 	Arguments:
@@ -72,12 +73,13 @@ void Protocol_updateRandomNodes(NodeCollection* nc, NodeCollection* rn);
  * 	Returns:
  * 		void
  *
- * 1. Append nc to rn
- * 2. Null out duplicate Nodes from in (using timestamp as priority)
- * 3. Calculate utility of nodes in NodeCollection in
- * 4. Sort in by utility (high to low)
- * 5. Grow if necessary
- * 6. Delete Nodes in in with index > M-K (size of in = M+K)
+ * 1. Calculate utility of nodes in NodeCollection nc that are not up to date
+ * 2. Merge nc into in (by nodeID, using timestamp as priority)
+ * 3. Grow if necessary
+ * 4. Keep the M-K best Nodes of in by utility, sorted high to low (size of in = M+K)
+ *
+ * Utility is calculated with respect to our position as of the last Protocol_timeout().
+ * Nothing is done after step 2 if no Node was new or newer to in.
  */
 void Protocol_updateImportantNodes(NodeCollection* nc, NodeCollection* in);
 
@@ -96,6 +98,8 @@ void Protocol_receiveFromPeer(int sock, NodeCollection* importantNodes, NodeColl
 /*
  * Protocol subroutine - local timeout triggered
  * Send randomNodes to a random Node, send importantNodes to an important Node
+ * If our position or coordination range has changed since the last timeout, the utility of
+ * importantNodes is recalculated here. Changes in between are thus applied at most once per timeout.
  * 	Arguments:
  * 		rn	- Pointer to NodeCollection of random Nodes
  * 		in	- Pointer to NodeCollection of important Nodes
@@ -121,12 +125,8 @@ void Protocol_bootstrap(uint32_t originPeerIP, uint16_t originPeerPort);
  *		type		- Type of correspondance (enum payloadType)
  *		peerNode	- Pointer to Node to send to
  *
- * Main steps taken:
- * 	1. Allocates new NodeCollection nc of size rn.size + 1
- * 	2. Creates Node ownNode
- * 	3. Prepends ownNode to top of nc
- * 	4. Copies contents of rn into nc
- *	5. Sends nc to peerNode
+ * Sends ownNode, followed by the Nodes of rn. These are packed straight from rn, without
+ * copying them to a NodeCollection first.
  */
 void Protocol_sendRandomNodes(NodeCollection* rn, payloadType type, Node* peerNode);
 
@@ -136,7 +136,76 @@ void Protocol_sendRandomNodes(NodeCollection* rn, payloadType type, Node* peerNo
  * 		in			- Pointer to NodeCollection of important nodes
  * 		type		- Type of correspondance (enum payloadType)
  * 		peerNode	- Pointer to Node to send to
+ *
+ * Sends ownNode, followed by the K Nodes of in with the highest utility for peerNode (all of
+ * them if there are no more than K), packed straight from in.
  */
 void Protocol_sendImportantNodes(NodeCollection* in, payloadType type, Node* peerNode);
 
+/*
+ * Preallocate everything needed to handle packets within a memory budget
+ * 	Arguments:
+ * 		in		- Pointer to NodeCollection of important nodes
+ * 		rn		- Pointer to NodeCollection of random nodes
+ * 		budget	- Memory budget in bytes
+ *
+ * 	Returns:
+ * 		uint32_t	- Number of important Nodes there is room for
+ *
+ * The receive and send buffers, and the NodeCollections used while handling a packet, are
+ * allocated once and reused. rn is preallocated at its size, in gets what is left of the budget
+ * (see NodeCollection_footprint()), but never less than its current size. Receiving, merging and
+ * sending then do no heap allocations, and in grows in place until it is full.
+ * Call once, before the first packet and before an event Arena is set (see mem_setArena()).
+ */
+uint32_t Protocol_preallocate(NodeCollection* in, NodeCollection* rn, size_t budget);
+
+/*
+ * Number of heap allocations made while handling packets and timeouts
+ * 	Returns:
+ * 		unsigned long	- Allocations, see mem_allocations()
+ */
+unsigned long Protocol_allocations();
+
+/*
+ * Size of the datagrams NodeCollections are sent in
+ * 	Returns:
+ * 		int		- CONFIG->NETWORK_pathMTU less the IP and UDP headers, MAX_PAYLOAD_BYTESIZE if
+ * 				  the path MTU is 0 (or larger). Room for two Nodes in any wire format at least
+ *
+ * A NodeCollection larger than this is sent in pages, see NodePage_fill(), instead of
+ * one datagram which IP would fragment and a single lost fragment would drop entirely.
+ */
+int Protocol_pageSize();
+
+/*
+ * Number of pages (datagrams of NodeCollections) sent to peers
+ * 	Returns:
+ * 		unsigned long	- Pages sent since start-up
+ */
+unsigned long Protocol_pagesSent();
+
+/*
+ * Number of valid NodeCollections received from peers, which are pages of what the peer sent
+ * 	Returns:
+ * 		unsigned long	- Pages received since start-up
+ */
+unsigned long Protocol_pagesReceived();
+
+/*
+ * Number of times a table was sent from the packed pages of the last time it was sent, as it
+ * had not changed since (within the same second, for v2 and v3). Only randomNodes, and
+ * importantNodes when all of it is sent, are cached.
+ * 	Returns:
+ * 		unsigned long	- Sends of a table from the cache since start-up
+ */
+unsigned long Protocol_cacheHits();
+
+/*
+ * Number of times a cached table had to be packed, see Protocol_cacheHits()
+ * 	Returns:
+ * 		unsigned long	- Sends of a table packed anew since start-up
+ */
+unsigned long Protocol_cacheMisses();
+
 #endif /* INCLUDE_PROTOCOL_H_ */
@@ -35,85 +35,475 @@
  *
  */
 
+#include <time.h>
+
 #include "upack/upack.h"
 #include "serialize.h"
 
-/* size(versionId, payloadType, nodeCount) = 5 bytes */
-#define NC_HEADER_OFFSET 5
-/* size(Node) in bytes */
-#define NODE_OFFSET ( (4 * 4) + \
-                      (3 * 2) + \
-                      (2 * 8))
+/* Largest record of a Node in the given wire format, 0 for unknown formats */
+static int Node_maxSize(int format){
+    switch(format){
+        case P2PDPRD_VERSION_ID:    return NODE_OFFSET;
+        case P2PDPRD_VERSION_ID_V2: return NODE_V2_MAX_OFFSET;
+        case P2PDPRD_VERSION_ID_V3: return NODE_V3_MAX_OFFSET;
+        default:                    return 0;
+    }
+}
 
 /* Serialize a NodeColletion to a byte-buffer */
 unsigned char* NodeCollection_pack(NodeCollection* nc, int* size){
     unsigned char* buff = NULL; /* Return buffer  */
     *size = 0;
     /* (Superficially) check validity of input data */
-    if(NodeCollection_isValid(nc)){
+    if(NodeCollection_isValid(nc) && Node_maxSize(NC_FORMAT(nc->versionID)) > 0){
         
+        /* The node count is 16 bits on the wire, larger collections are cut */
+        uint16_t nodeCount = nc->nodeCount > UINT16_MAX ? UINT16_MAX : nc->nodeCount;
+
         /* Calculate needed buffer size */
-        buff = malloc(NC_HEADER_OFFSET + (nc->nodeCount * NODE_OFFSET));    
-
-        /* Pack fields using upack */
-        int sz = 0;
-        pack16(buff, nc->versionID);        sz += 2;
-        pack8(buff + sz, nc->payloadType);  sz++;
-        pack16(buff + sz, nc->nodeCount);   sz += 2;
-
-        /* Pack each node in buffer successively */
-        int i;
-        for(i = 0 ; i < nc->nodeCount ; i++){
-            pack32(buff + sz, nc->nodes[i].nodeID);     sz += 4;
-            packdouble(buff + sz, nc->nodes[i].lat);    sz += 8;
-            packdouble(buff + sz, nc->nodes[i].lon);    sz += 8;
-            pack16(buff + sz, nc->nodes[i].coordRange); sz += 2;
-            pack32(buff + sz, nc->nodes[i].ipAddr);     sz += 4;
-            pack16(buff + sz, nc->nodes[i].port);       sz += 2;
-            pack32(buff + sz, nc->nodes[i].radac_ip);   sz += 4;
-            pack16(buff + sz, nc->nodes[i].radac_port); sz += 2;
-            pack32(buff + sz, nc->nodes[i].timeStamp);  sz += 4;
-       }
-       *size = sz;
-
-       /* TEST */
-       
+        int buff_size = NC_HEADER_OFFSET + (nodeCount * Node_maxSize(NC_FORMAT(nc->versionID)));
+        buff = mem_new(buff_size);
 
+        *size = NodeCollection_packTo(nc, buff, buff_size);
    }
    return buff;
 }
 
+/* Reference of the first record in a packet */
+static void NodeDeltaRef_init(NodeDeltaRef* ref){
+    memset(ref, 0, sizeof(NodeDeltaRef));
+    ref->radac_port = CFG_DEFAULT_RADAC_PORT;
+}
+
+/* Packs n as a v3 record, and moves ref on to it */
+static int Node_packV3(unsigned char* buff, const Node* n, uint32_t now, NodeDeltaRef* ref){
+    uint8_t flags = NODE_V2_ACCEPTS_V2 | NODE_V2_ACCEPTS_V3;
+    if(n->radac_ip != n->ipAddr) flags |= NODE_V2_RADAC_IP;
+    if(n->radac_port != ref->radac_port) flags |= NODE_V2_RADAC_PORT;
+    if(n->wireVersion < P2PDPRD_VERSION_ID_V3) flags &= ~NODE_V2_ACCEPTS_V3;
+    if(n->wireVersion < P2PDPRD_VERSION_ID_V2) flags &= ~NODE_V2_ACCEPTS_V2;
+
+#ifdef P2PDPRD_FIXED_POINT
+    int32_t lat = n->fixLat, lon = n->fixLon;
+#else
+    int32_t lat = geo_fixed_degrees(n->lat, 90), lon = geo_fixed_degrees(n->lon, 180);
+#endif
+    int sz = 4;
+    upack_put32(buff, n->nodeID);
+    sz += upack_putvarint(buff + sz, upack_zigzag(lat - ref->lat));
+    sz += upack_putvarint(buff + sz, upack_zigzag(lon - ref->lon));
+    sz += upack_putvarint(buff + sz, n->coordRange);
+    sz += upack_putvarint(buff + sz, n->ipAddr ^ ref->ipAddr);
+    sz += upack_putvarint(buff + sz, upack_zigzag((int32_t)n->port - ref->port));
+    buff[sz++] = flags;
+    if(flags & NODE_V2_RADAC_IP){
+        sz += upack_putvarint(buff + sz, n->radac_ip ^ n->ipAddr);
+    }
+    if(flags & NODE_V2_RADAC_PORT){
+        sz += upack_putvarint(buff + sz, n->radac_port ^ ref->radac_port);
+    }
+    sz += upack_putvarint(buff + sz, now > n->timeStamp ? now - n->timeStamp : 0);
+
+    ref->lat = lat;
+    ref->lon = lon;
+    ref->ipAddr = n->ipAddr;
+    ref->port = n->port;
+    ref->radac_port = n->radac_port;
+    return sz;
+}
+
+/* Unpacks a v3 record of at most size bytes, and moves ref on to it. Returns its size, 0 if it runs past size */
+static int Node_unpackV3(const unsigned char* buff, int size, Node* n, uint32_t now, NodeDeltaRef* ref){
+    uint32_t v[6], age, radac_ip = 0, radac_port = 0;
+    int sz = 4, i, vsz;
+    if(size < 4){
+        return 0;
+    }
+    /* lat, lon, coordRange, ipAddr, port */
+    for(i = 0 ; i < 5 ; i++, sz += vsz){
+        if((vsz = upack_getvarint(buff + sz, size - sz, &v[i])) == 0){
+            return 0;
+        }
+    }
+    if(sz >= size){
+        return 0;
+    }
+    uint8_t flags = buff[sz++];
+    if(flags & NODE_V2_RADAC_IP){
+        if((vsz = upack_getvarint(buff + sz, size - sz, &radac_ip)) == 0){
+            return 0;
+        }
+        sz += vsz;
+    }
+    if(flags & NODE_V2_RADAC_PORT){
+        if((vsz = upack_getvarint(buff + sz, size - sz, &radac_port)) == 0){
+            return 0;
+        }
+        sz += vsz;
+    }
+    if((vsz = upack_getvarint(buff + sz, size - sz, &age)) == 0){
+        return 0;
+    }
+
+    ref->lat += upack_unzigzag(v[0]);
+    ref->lon += upack_unzigzag(v[1]);
+    ref->ipAddr ^= v[3];
+    ref->port += upack_unzigzag(v[4]);
+    ref->radac_port ^= radac_port;
+
+    n->nodeID = upack_get32(buff);
+    Node_setPosition(n, ref->lat / (double)GEO_FIXED_SCALE, ref->lon / (double)GEO_FIXED_SCALE);
+    n->coordRange = v[2];
+    n->ipAddr = ref->ipAddr;
+    n->port = ref->port;
+    n->radac_ip = n->ipAddr ^ radac_ip;
+    n->radac_port = ref->radac_port;
+    n->timeStamp = now > age ? now - age : 0;
+    n->wireVersion = flags & NODE_V2_ACCEPTS_V3 ? P2PDPRD_VERSION_ID_V3 :
+            flags & NODE_V2_ACCEPTS_V2 ? P2PDPRD_VERSION_ID_V2 : P2PDPRD_VERSION_ID;
+    n->utility = 0;
+    n->utilityEpoch = 0;
+    return sz + vsz;
+}
+
+/* Packs n in the given wire format if its record fits in room bytes. Returns its size, 0 if not */
+static int Node_packFormat(int format, unsigned char* buff, int room, const Node* n, uint32_t now, NodeDeltaRef* ref){
+    if(format == P2PDPRD_VERSION_ID){
+        if(room < NODE_OFFSET){
+            return 0;
+        }
+        Node_pack(buff, n);
+        return NODE_OFFSET;
+    }
+    if(room >= Node_maxSize(format)){
+        return format == P2PDPRD_VERSION_ID_V3 ? Node_packV3(buff, n, now, ref) : Node_packV2(buff, n, now);
+    }
+
+    /* Might not fit, try it on the side (and leave ref alone if it does not) */
+    unsigned char record[NODE_V3_MAX_OFFSET];
+    NodeDeltaRef next = *ref;
+    int sz = format == P2PDPRD_VERSION_ID_V3 ? Node_packV3(record, n, now, &next) : Node_packV2(record, n, now);
+    if(sz > room){
+        return 0;
+    }
+    memcpy(buff, record, sz);
+    *ref = next;
+    return sz;
+}
+
+int NodeCollection_packTo(NodeCollection* nc, unsigned char* buff, int buff_size){
+    if(!NodeCollection_isValid(nc)){
+        return 0;
+    }
+
+    /* The node count is 16 bits on the wire, larger collections are cut */
+    uint16_t nodeCount = nc->nodeCount > UINT16_MAX ? UINT16_MAX : nc->nodeCount;
+    int format = NC_FORMAT(nc->versionID);
+    int nodeSize = Node_maxSize(format);
+    if(nodeSize == 0 || NC_HEADER_OFFSET + (nodeCount * nodeSize) > buff_size){
+        return 0;
+    }
+
+    /* Pack fields using upack */
+    int sz = 0;
+    pack16(buff, nc->versionID);        sz += 2;
+    pack8(buff + sz, nc->payloadType);  sz++;
+    pack16(buff + sz, nodeCount);       sz += 2;
+
+    /* Pack the nodes in buffer successively */
+    if(format == P2PDPRD_VERSION_ID){
+        Node_packArray(buff + sz, nc->nodes, nodeCount);
+        return sz + nodeCount * NODE_OFFSET;
+    }
+    uint32_t now = time(NULL);
+    NodeDeltaRef ref;
+    NodeDeltaRef_init(&ref);
+    int i;
+    for(i = 0 ; i < nodeCount ; i++){
+        sz += Node_packFormat(format, buff + sz, buff_size - sz, &nc->nodes[i], now, &ref);
+    }
+    return sz;
+}
+
+int NodePage_begin(NodePage* page, uint16_t versionID, payloadType type, const Node* sender){
+    page->format = NC_FORMAT(versionID);
+    page->headSize = 0;
+    if(Node_maxSize(page->format) == 0){
+        return 0;
+    }
+    page->now = time(NULL);
+    NodeDeltaRef_init(&page->ref);
+
+    pack16(page->head, versionID);
+    pack8(page->head + 2, type);
+    pack16(page->head + 3, 1);
+    page->headSize = NC_HEADER_OFFSET + Node_packFormat(page->format, page->head + NC_HEADER_OFFSET,
+            sizeof(page->head) - NC_HEADER_OFFSET, sender, page->now, &page->ref);
+    return page->headSize;
+}
+
+void NodePage_setHeader(NodePage* page, payloadType type, uint16_t nodeCount){
+    pack8(page->head + 2, type);
+    pack16(page->head + 3, nodeCount);
+}
+
+int NodePage_fill(NodePage* page, const Node* nodes, const int* order, int count, int* next,
+        unsigned char* buff, int buff_size){
+    if(page->headSize == 0){
+        return 0;
+    }
+
+    /* Every page is coded on its own, starting from the record of the sender */
+    NodeDeltaRef ref = page->ref;
+    int sz = 0, rsz;
+    uint16_t nodeCount = 1;
+    while(*next < count && nodeCount < UINT16_MAX &&
+            (rsz = Node_packFormat(page->format, buff + sz, buff_size - sz,
+                    &nodes[order ? order[*next] : *next], page->now, &ref)) > 0){
+        sz += rsz;
+        nodeCount++;
+        (*next)++;
+    }
+    pack16(page->head + 3, nodeCount);
+    return sz;
+}
+
+/* The fields of a Node record are at fixed offsets, written with the inline upack functions */
+void Node_pack(unsigned char* buff, const Node* n){
+    upack_put32(buff, n->nodeID);
+    upack_putdouble(buff + 4, Node_lat(n));
+    upack_putdouble(buff + 12, Node_lon(n));
+    upack_put16(buff + 20, n->coordRange);
+    upack_put32(buff + 22, n->ipAddr);
+    upack_put16(buff + 26, n->port);
+    upack_put32(buff + 28, n->radac_ip);
+    upack_put16(buff + 32, n->radac_port);
+    upack_put32(buff + 34, n->timeStamp);
+}
+
+void Node_packArray(unsigned char* buff, const Node* nodes, int count){
+    int i;
+    for(i = 0 ; i < count ; i++){
+        Node_pack(buff + i * NODE_OFFSET, &nodes[i]);
+    }
+}
+
+void Node_unpack(const unsigned char* buff, Node* n){
+    n->nodeID = upack_get32(buff);
+    Node_setPosition(n, upack_getdouble(buff + 4), upack_getdouble(buff + 12));
+    n->coordRange = upack_get16(buff + 20);
+    n->ipAddr = upack_get32(buff + 22);
+    n->port = upack_get16(buff + 26);
+    n->radac_ip = upack_get32(buff + 28);
+    n->radac_port = upack_get16(buff + 32);
+    n->timeStamp = upack_get32(buff + 34);
+    n->wireVersion = P2PDPRD_VERSION_ID;
+    n->utility = 0;
+    n->utilityEpoch = 0;
+}
+
+void Node_unpackArray(const unsigned char* buff, Node* nodes, int count){
+    int i;
+    for(i = 0 ; i < count ; i++){
+        Node_unpack(buff + i * NODE_OFFSET, &nodes[i]);
+    }
+}
+
+int Node_packV2(unsigned char* buff, const Node* n, uint32_t now){
+    uint8_t flags = 0;
+    if(n->radac_ip != n->ipAddr) flags |= NODE_V2_RADAC_IP;
+    if(n->radac_port != CFG_DEFAULT_RADAC_PORT) flags |= NODE_V2_RADAC_PORT;
+    if(n->wireVersion >= P2PDPRD_VERSION_ID_V2) flags |= NODE_V2_ACCEPTS_V2;
+    if(n->wireVersion >= P2PDPRD_VERSION_ID_V3) flags |= NODE_V2_ACCEPTS_V3;
+
+    upack_put32(buff, n->nodeID);
+#ifdef P2PDPRD_FIXED_POINT
+    upack_put32(buff + 4, (uint32_t)n->fixLat);
+    upack_put32(buff + 8, (uint32_t)n->fixLon);
+#else
+    upack_put32(buff + 4, (uint32_t)geo_fixed_degrees(n->lat, 90));
+    upack_put32(buff + 8, (uint32_t)geo_fixed_degrees(n->lon, 180));
+#endif
+    upack_put16(buff + 12, n->coordRange);
+    upack_put32(buff + 14, n->ipAddr);
+    upack_put16(buff + 18, n->port);
+    buff[20] = flags;
+
+    int sz = 21;
+    if(flags & NODE_V2_RADAC_IP){
+        upack_put32(buff + sz, n->radac_ip);    sz += 4;
+    }
+    if(flags & NODE_V2_RADAC_PORT){
+        upack_put16(buff + sz, n->radac_port);  sz += 2;
+    }
+    return sz + upack_putvarint(buff + sz, now > n->timeStamp ? now - n->timeStamp : 0);
+}
+
+int Node_unpackV2(const unsigned char* buff, int size, Node* n, uint32_t now){
+    if(size < NODE_V2_MIN_OFFSET){
+        return 0;
+    }
+    uint8_t flags = buff[20];
+    int sz = 21 + (flags & NODE_V2_RADAC_IP ? 4 : 0) + (flags & NODE_V2_RADAC_PORT ? 2 : 0);
+    uint32_t age;
+    int ageSize = sz < size ? upack_getvarint(buff + sz, size - sz, &age) : 0;
+    if(ageSize == 0){
+        return 0;
+    }
+
+    n->nodeID = upack_get32(buff);
+    Node_setPosition(n, (int32_t)upack_get32(buff + 4) / (double)GEO_FIXED_SCALE,
+            (int32_t)upack_get32(buff + 8) / (double)GEO_FIXED_SCALE);
+    n->coordRange = upack_get16(buff + 12);
+    n->ipAddr = upack_get32(buff + 14);
+    n->port = upack_get16(buff + 18);
+    n->radac_ip = flags & NODE_V2_RADAC_IP ? upack_get32(buff + 21) : n->ipAddr;
+    n->radac_port = flags & NODE_V2_RADAC_PORT ? upack_get16(buff + sz - 2) : CFG_DEFAULT_RADAC_PORT;
+    n->timeStamp = now > age ? now - age : 0;
+    n->wireVersion = flags & NODE_V2_ACCEPTS_V3 ? P2PDPRD_VERSION_ID_V3 :
+            flags & NODE_V2_ACCEPTS_V2 ? P2PDPRD_VERSION_ID_V2 : P2PDPRD_VERSION_ID;
+    n->utility = 0;
+    n->utilityEpoch = 0;
+    return sz + ageSize;
+}
+
 NodeCollection* NodeCollection_unpack(unsigned char* buff, int size, int* num){
     NodeCollection* nc = NULL;
-    
-    if(buff != NULL && size > 0){
-        int o = 0; // Track buffer offset
-
-        /* Unpack header fields */
-        uint16_t versionID = unpacku16(buff);       o += 2;
-        uint8_t payloadType = unpacku8(buff + o);   o += 1;
-        uint16_t nodeCount = unpacku16(buff + o);   o += 2;
-       
+    *num = 0;
+
+    if(buff != NULL && size >= NC_HEADER_OFFSET){
+        /* Unpack header fields, to size the NodeCollection */
+        uint16_t versionID = unpacku16(buff);
+        uint8_t payloadType = unpacku8(buff + 2);
+        uint16_t nodeCount = unpacku16(buff + 3);
+
         nc = NodeCollection_new(versionID, payloadType, nodeCount);
-        *num = nodeCount;
-        nc->nodeCount = nodeCount;
-
-        int i; /* Track node number */
-        for(i = 0 ; i < nc->nodeCount ; i++){
-            nc->nodes[i].nodeID = unpacku32(buff + o);      o += 4;
-            nc->nodes[i].lat = unpackdouble(buff + o);      o += 8;
-            nc->nodes[i].lon = unpackdouble(buff + o);      o += 8;
-            nc->nodes[i].coordRange = unpacku16(buff + o);  o += 2;
-            nc->nodes[i].ipAddr = unpacku32(buff + o);      o += 4;
-            nc->nodes[i].port = unpacku16(buff + o);        o += 2;
-            nc->nodes[i].radac_ip = unpacku32(buff + o);    o += 4;
-            nc->nodes[i].radac_port = unpacku16(buff + o);  o += 2;
-            nc->nodes[i].timeStamp = unpacku32(buff + o);   o += 4;
+        if(NodeCollection_unpackTo(buff, size, nc) < 0){
+            NodeCollection_destroy(nc);
+            return NULL;
         }
+        *num = nc->nodeCount;
     }
     return nc;
 }
 
+int NodeCollection_unpackTo(unsigned char* buff, int size, NodeCollection* nc){
+    NodePacket packet;
+    NodePacketReader reader;
+    nc->nodeCount = 0;
+    if(NodePacket_open(&packet, buff, size) < 0 || packet.nodeCount > nc->maxNodeCount){
+        return -1;
+    }
+
+    int nodeCount = 0, read;
+    NodePacket_begin(&packet, &reader);
+    while((read = NodePacket_next(&reader, &nc->nodes[nodeCount])) > 0){
+        nodeCount++;
+    }
+    if(read < 0){
+        return -1;
+    }
+
+    nc->versionID = packet.versionID;
+    nc->payloadType = packet.payloadType;
+    nc->nodeCount = nodeCount;
+    if(nc->index){
+        NodeCollection_buildIndex(nc);
+    }
+    nc->version++;
+    return nodeCount;
+}
+
+/* Everything that can be checked without decoding the records */
+int NodePacket_open(NodePacket* p, const unsigned char* buff, int size){
+    if(buff == NULL || size < NC_HEADER_OFFSET){
+        return -1;
+    }
+    p->buff = buff;
+    p->size = size;
+    p->versionID = upack_get16(buff);
+    p->payloadType = buff[2];
+    p->nodeCount = upack_get16(buff + 3);
+
+    int records = size - NC_HEADER_OFFSET;
+    switch(NC_FORMAT(p->versionID)){
+        case P2PDPRD_VERSION_ID:
+            return p->nodeCount * NODE_OFFSET <= records ? 0 : -1;
+        case P2PDPRD_VERSION_ID_V2:
+            return p->nodeCount * NODE_V2_MIN_OFFSET <= records ? 0 : -1;
+        case P2PDPRD_VERSION_ID_V3:
+            return p->nodeCount * NODE_V3_MIN_OFFSET <= records ? 0 : -1;
+        default:
+            return -1;
+    }
+}
+
+void NodePacket_begin(const NodePacket* p, NodePacketReader* r){
+    r->packet = p;
+    r->offset = NC_HEADER_OFFSET;
+    r->index = 0;
+    r->now = time(NULL);
+    NodeDeltaRef_init(&r->ref);
+}
+
+int NodePacket_next(NodePacketReader* r, Node* n){
+    const NodePacket* p = r->packet;
+    if(r->index >= p->nodeCount){
+        return 0;
+    }
+
+    int sz;
+    switch(NC_FORMAT(p->versionID)){
+        case P2PDPRD_VERSION_ID:
+            /* All records are known to fit, see NodePacket_open() */
+            Node_unpack(p->buff + r->offset, n);
+            /* The record of the sender itself is first, and the header says which formats it accepts */
+            if(r->index == 0){
+                n->wireVersion = NC_ACCEPTS(p->versionID);
+            }
+            sz = NODE_OFFSET;
+            break;
+        case P2PDPRD_VERSION_ID_V2:
+            sz = Node_unpackV2(p->buff + r->offset, p->size - r->offset, n, r->now);
+            break;
+        default:
+            sz = Node_unpackV3(p->buff + r->offset, p->size - r->offset, n, r->now, &r->ref);
+            break;
+    }
+    if(sz == 0){
+        r->index = p->nodeCount;    /* Malformed, stop here */
+        return -1;
+    }
+    r->offset += sz;
+    r->index++;
+    return 1;
+}
+
+int NodePacket_validate(const NodePacket* p){
+    NodePacketReader reader;
+    Node n;
+    int read;
+    NodePacket_begin(p, &reader);
+    while((read = NodePacket_next(&reader, &n)) > 0)
+        ;
+    return read < 0 ? -1 : 0;
+}
+
+void NodePacket_print(const NodePacket* p){
+    NodePacketReader r;
+    Node n;
+    int k = 0;
+
+    printf("NodeCollection:versionID = %d \t type = %d \t nodeCount = %d\n",
+            p->versionID, p->payloadType, p->nodeCount);
+    NodePacket_begin(p, &r);
+    while(NodePacket_next(&r, &n) > 0){
+        printf("%d \t - %d \t %f \t %f \t %d \t %d \t %d \t %d \t %d \t %d \n", k++,
+                n.nodeID, Node_lat(&n), Node_lon(&n), n.coordRange, n.ipAddr, n.port,
+                n.radac_ip, n.radac_port, n.timeStamp);
+    }
+}
+
 LocalRequest* LocalRequest_unpack(unsigned char* buff, int buff_size){
     LocalRequest* lr = NULL;
     
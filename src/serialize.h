@@ -51,21 +51,212 @@
 #include "protocol.h"
 #include "node.h"
 #include "io.h"
+#include "upack/upack.h"
 
 /* Constants used while packing/unpacking structured data */
 #define NODECOLL_VAR_CNT 3
 #define NODE_VAR_CNT 9
 
-/* Pack a NodeCollection to a byte buffer
+/* size(versionId, payloadType, nodeCount) = 5 bytes */
+#define NC_HEADER_OFFSET 5
+/* size(Node) in bytes */
+#define NODE_OFFSET ( (4 * 4) + \
+                      (3 * 2) + \
+                      (2 * 8))
+/* size(Node) in bytes in the v2 format, without the optional fields and with an age below 128 s */
+#define NODE_V2_MIN_OFFSET ( (4 * 4) + \
+                             (2 * 2) + \
+                             (2 * 1))
+/* ... and with all of them and the longest age */
+#define NODE_V2_MAX_OFFSET (NODE_V2_MIN_OFFSET + 4 + 2 + UPACK_VARINT_MAX - 1)
+/* size(Node) in bytes in the v3 format at least: nodeID, flags and six one-byte varints */
+#define NODE_V3_MIN_OFFSET (4 + 1 + 6)
+/* size(Node) in bytes in the v3 format at most: nodeID, flags and eight varints, three of them 16-bit */
+#define NODE_V3_MAX_OFFSET (4 + 1 + 5 * UPACK_VARINT_MAX + 3 * 3)
+/* size(Node) in bytes at most, in any format (v3 records are the longest) */
+#define NODE_MAX_OFFSET (NODE_V3_MAX_OFFSET > NODE_OFFSET ? NODE_V3_MAX_OFFSET : NODE_OFFSET)
+/* Max amount of Nodes in a received NodeCollection: as many of the shortest records of any format
+ * (v3) as fit in a packet */
+#define NC_MAX_PACKET_NODES ((MAX_PAYLOAD_BYTESIZE - NC_HEADER_OFFSET) / NODE_V3_MIN_OFFSET)
+
+/* Flags of a v2 Node record, telling which optional fields follow */
+#define NODE_V2_RADAC_IP	0x01	/* radac_ip follows. Else it is the ipAddr of the Node */
+#define NODE_V2_RADAC_PORT	0x02	/* radac_port follows. Else it is CFG_DEFAULT_RADAC_PORT */
+#define NODE_V2_ACCEPTS_V2	0x04	/* The Node accepts v2 packets */
+#define NODE_V2_ACCEPTS_V3	0x08	/* The Node accepts v3 packets */
+
+/* v3 is v2 compressed: the fields of each record but nodeID are varints, coded against the record
+ * before it in the packet (the first against zero and CFG_DEFAULT_RADAC_PORT). lat, lon and port
+ * are zigzag deltas, ipAddr is XOR'ed with the previous one and radac_ip with ipAddr. radac_port,
+ * XOR'ed with the previous one, follows only if it differs. Nodes of the same area and network
+ * then take about 15 bytes. Each packet (page) is coded on its own. */
+
+/* The low byte of the versionID of a packet is its wire format, the high byte the highest format
+ * its sender accepts, if that is higher. v1 peers send 1, and read every packet as v1, so a
+ * NodeCollection is only packed as v2 for peers which have said they accept it. */
+#define NC_FORMAT(versionID) ((versionID) & 0xff)
+#define NC_ACCEPTS(versionID) ((versionID) >> 8 > NC_FORMAT(versionID) ? (versionID) >> 8 : NC_FORMAT(versionID))
+#define NC_VERSION(format, accepts) ((format) | ((accepts) > (format) ? (accepts) << 8 : 0))
+
+/* What a v3 record is coded against: the fields of the record before it in the packet */
+typedef struct NodeDeltaRef {
+	int32_t		lat;
+	int32_t		lon;
+	uint32_t	ipAddr;
+	uint16_t	port;
+	uint16_t	radac_port;
+} NodeDeltaRef;
+
+/* Read-only view of a received packet, see NodePacket_open(). The Nodes are decoded one at a
+ * time, straight from the buffer, with a NodePacketReader */
+typedef struct NodePacket {
+	const unsigned char*	buff;		/* The packet. Not copied, must outlive the view */
+	int						size;		/* Size of the packet */
+	uint16_t				versionID;	/* Header fields */
+	uint8_t					payloadType;
+	uint16_t				nodeCount;
+} NodePacket;
+
+/* Position of a NodePacketReader in a NodePacket */
+typedef struct NodePacketReader {
+	const NodePacket*	packet;
+	int					offset;		/* Of the next record */
+	int					index;		/* Of the next record */
+	uint32_t			now;		/* Time ages are counted from */
+	NodeDeltaRef		ref;		/* v3 only */
+} NodePacketReader;
+
+/* A page being packed straight from where the Nodes are kept, see NodePage_begin(). The header and
+ * the record of the sender go to head, the other Nodes to a buffer of the caller, so the two can
+ * be sent as one datagram with IO_sendVector() */
+typedef struct NodePage {
+	unsigned char	head[NC_HEADER_OFFSET + NODE_MAX_OFFSET];
+	int				headSize;	/* 0 if the format is not known */
+	int				format;
+	uint32_t		now;		/* Time ages are counted from */
+	NodeDeltaRef	ref;		/* v3: after the record of the sender */
+} NodePage;
+
+/* Pack a NodeCollection to a byte buffer, in the wire format of its versionID (see NC_FORMAT())
  * 	Arguments:
  * 		nc 		- NodeCollection* to pack in byte buffer
  * 		size 	- Used to return size of resulting buffer
  *
  * 	Return:
- * 		char*	- Pointer to resulting byte buffer
+ * 		char*	- Pointer to resulting byte buffer, allocated with mem_new(). Free with mem_free()
  */
 unsigned char* NodeCollection_pack(NodeCollection* nc, int* size);
 
+/* Pack a NodeCollection to a given byte buffer
+ * 	Arguments:
+ * 		nc 			- NodeCollection* to pack
+ * 		buff		- Buffer to pack to
+ * 		buff_size	- Size of buff
+ *
+ * 	Return:
+ * 		int		- Size of the packed NodeCollection, 0 if nc is not valid or does not fit in buff.
+ * 				  NC_HEADER_OFFSET + nc->nodeCount * NODE_MAX_OFFSET at most (NODE_OFFSET per
+ * 				  Node in v1, up to NODE_V3_MAX_OFFSET in v3)
+ */
+int NodeCollection_packTo(NodeCollection* nc, unsigned char* buff, int buff_size);
+
+/* Start a page: pack the header and the record of the sender to page->head
+ * 	Arguments:
+ * 		page		- NodePage to start
+ * 		versionID	- versionID of the packet, its low byte the wire format (see NC_VERSION())
+ * 		type		- payloadType of the packet
+ * 		sender		- Node of the sender, first on the page
+ *
+ * 	Return:
+ * 		int		- page->headSize, 0 if the wire format is not known
+ */
+int NodePage_begin(NodePage* page, uint16_t versionID, payloadType type, const Node* sender);
+
+/* Set the payloadType and Node count (the sender included) in the header of a page
+ * 	Arguments:
+ * 		page		- NodePage started with NodePage_begin()
+ * 		type		- payloadType of the packet
+ * 		nodeCount	- Number of Nodes on the page, set by NodePage_fill() too
+ */
+void NodePage_setHeader(NodePage* page, payloadType type, uint16_t nodeCount);
+
+/* Pack as many Nodes as fit in buff after the sender of a page, and count them in its header
+ * 	Arguments:
+ * 		page		- NodePage started with NodePage_begin()
+ * 		nodes		- Nodes to pack from, e.g. the nodes of a NodeCollection. Not copied
+ * 		order		- Indices into nodes to pack them in, NULL to pack them as they are
+ * 		count		- Number of Nodes (or indices in order)
+ * 		next		- Index of the first Node to pack, start at 0. Advanced past the packed
+ * 					  Nodes, they are all sent when it reaches count
+ * 		buff		- Buffer to pack to, sent after page->head
+ * 		buff_size	- Size of buff
+ *
+ * 	Return:
+ * 		int		- Number of bytes packed to buff
+ *
+ * 	Every page starts with the Node of the sender, followed by as many of the next Nodes as fit,
+ * 	so that each page is a NodeCollection of its own and the Nodes keep their order. Fill a page
+ * 	at a time, until next reaches count.
+ */
+int NodePage_fill(NodePage* page, const Node* nodes, const int* order, int count, int* next,
+		unsigned char* buff, int buff_size);
+
+/* Pack a Node to a byte buffer, as NodeCollection_pack() does
+ * 	Arguments:
+ * 		buff	- Buffer to pack to, with room for NODE_OFFSET bytes
+ * 		n		- Node to pack
+ */
+void Node_pack(unsigned char* buff, const Node* n);
+
+/* Pack an array of Nodes to a byte buffer, one record after the other
+ * 	Arguments:
+ * 		buff	- Buffer to pack to, with room for count * NODE_OFFSET bytes
+ * 		nodes	- Nodes to pack
+ * 		count	- Number of Nodes
+ */
+void Node_packArray(unsigned char* buff, const Node* nodes, int count);
+
+/* Unpack a Node from a byte buffer
+ * 	Arguments:
+ * 		buff	- Buffer holding a Node record (NODE_OFFSET bytes)
+ * 		n		- Node to unpack to. Utility is zeroed, and wireVersion P2PDPRD_VERSION_ID
+ */
+void Node_unpack(const unsigned char* buff, Node* n);
+
+/* Unpack an array of Nodes from a byte buffer
+ * 	Arguments:
+ * 		buff	- Buffer holding count Node records
+ * 		nodes	- Nodes to unpack to
+ * 		count	- Number of Nodes
+ */
+void Node_unpackArray(const unsigned char* buff, Node* nodes, int count);
+
+/* Pack a Node in the v2 format: nodeID, lat/lon in micro-degrees (int32), coordRange, ipAddr,
+ * port, flags (NODE_V2_*), radac_ip and radac_port unless they are the defaults, and the age of
+ * timeStamp in seconds as a varint. The receiver takes its own time less the age as timeStamp,
+ * so the clocks of the two do not need to agree.
+ * 	Arguments:
+ * 		buff	- Buffer to pack to, with room for NODE_V2_MAX_OFFSET bytes
+ * 		n		- Node to pack
+ * 		now		- Current time, which the age is counted from
+ *
+ * 	Return:
+ * 		int		- Size of the record, NODE_V2_MIN_OFFSET to NODE_V2_MAX_OFFSET bytes
+ */
+int Node_packV2(unsigned char* buff, const Node* n, uint32_t now);
+
+/* Unpack a v2 Node record
+ * 	Arguments:
+ * 		buff	- Buffer holding the record
+ * 		size	- Bytes left in buff
+ * 		n		- Node to unpack to. Utility is zeroed
+ * 		now		- Current time, which the age is subtracted from
+ *
+ * 	Return:
+ * 		int		- Size of the record, 0 if it runs past size bytes
+ */
+int Node_unpackV2(const unsigned char* buff, int size, Node* n, uint32_t now);
+
 /* Unpack a NodeCollection from a byte buffer
  *  Arguments:
  *  	buff	- Buffer to unpack to
@@ -73,10 +264,72 @@ unsigned char* NodeCollection_pack(NodeCollection* nc, int* size);
  *  	num		- Amount of Nodes are written to num
  *
  * 	Return:
- * 		NodeCollection* - Pointer to unpacked NodeCollection
+ * 		NodeCollection* - Pointer to unpacked NodeCollection, NULL if the buffer is too short for
+ * 						  its node count or of an unknown wire format
  */
 NodeCollection* NodeCollection_unpack(unsigned char* buff, int size, int *num);
 
+/* Unpack a NodeCollection from a byte buffer into an existing NodeCollection
+ *  Arguments:
+ *  	buff	- Buffer to unpack
+ *  	size	- Size of buffer
+ *  	nc		- NodeCollection to unpack to. Its Nodes are replaced
+ *
+ * 	Return:
+ * 		int		- Amount of unpacked Nodes, -1 if the buffer is too short for its node count, is of
+ * 				  an unknown wire format or nc does not have room for them (nc is then left empty)
+ */
+int NodeCollection_unpackTo(unsigned char* buff, int size, NodeCollection* nc);
+
+/* Open a view of a received packet
+ * 	Arguments:
+ * 		p		- NodePacket to set up
+ * 		buff	- The packet
+ * 		size	- Size of the packet
+ *
+ * 	Return:
+ * 		int		- 0 if the packet can be read, -1 if its header is short, its wire format unknown
+ * 				  or it is too short for its node count
+ *
+ * 	Checks only the header, in O(1), and does not allocate. v1 records are then known to be in
+ * 	bounds. v2 and v3 records are of varying size and checked one by one by NodePacket_next(),
+ * 	or all at once by NodePacket_validate().
+ */
+int NodePacket_open(NodePacket* p, const unsigned char* buff, int size);
+
+/* Start reading the Nodes of a NodePacket from the first one (the Node of the sender)
+ * 	Arguments:
+ * 		p		- Opened NodePacket
+ * 		r		- Reader to set up
+ */
+void NodePacket_begin(const NodePacket* p, NodePacketReader* r);
+
+/* Decode the next Node of a NodePacket
+ * 	Arguments:
+ * 		r		- Reader, see NodePacket_begin()
+ * 		n		- Node to decode to, as NodeCollection_unpackTo() would
+ *
+ * 	Return:
+ * 		int		- 1 if a Node was decoded, 0 after the last one, -1 if the record runs past the
+ * 				  end of the packet. The reader stops there, the Nodes before it are valid
+ */
+int NodePacket_next(NodePacketReader* r, Node* n);
+
+/* Check that every record of a NodePacket decodes, without keeping any of them
+ * 	Arguments:
+ * 		p		- Opened NodePacket
+ *
+ * 	Return:
+ * 		int		- 0 if all p->nodeCount Nodes can be read with NodePacket_next(), -1 if not
+ *
+ * 	For when the Nodes are used as they are read, and a packet that is cut short should not be
+ * 	used at all.
+ */
+int NodePacket_validate(const NodePacket* p);
+
+/* Print a NodePacket as NodeCollection_print() does */
+void NodePacket_print(const NodePacket* p);
+
 /* Unpack a locally received request from byte buffer
  *	Arguments:
  *		buff	- Buffer to unpack to
@@ -38,21 +38,54 @@
 #include "subscribe.h"
 #include <string.h>
 
+#include "utilities.h"
+
+/* A Subscriber and its address, allocated together */
+typedef struct SubscriberObject {
+	Subscriber	sub;
+	char		address[SUBSCRIBER_POOL_ADDRESS_LENGTH];
+} SubscriberObject;
+
+static Pool* subscriberPool = NULL;
+
+void Subscriber_initPool(uint32_t count){
+	if(!subscriberPool){
+		subscriberPool = Pool_new(sizeof(SubscriberObject), count);
+	}
+}
+
+void Subscriber_freePool(){
+	Pool_destroy(subscriberPool);
+	subscriberPool = NULL;
+}
+
 Subscriber* Subscriber_new(char* address, unsigned int address_length){
-	Subscriber* cs = malloc(sizeof(Subscriber));
-	cs->socket_address = malloc(address_length);
+	Subscriber* cs;
+	SubscriberObject* o = address_length <= SUBSCRIBER_POOL_ADDRESS_LENGTH ? Pool_get(subscriberPool) : NULL;
+	if(o){
+		cs = &o->sub;
+		cs->socket_address = o->address;
+	} else {
+		/* Subscribers outlive the event they are made in, so they are not made with mem_new() */
+		cs = mem_alloc(sizeof(Subscriber));
+		cs->socket_address = mem_alloc(address_length);
+	}
 	cs->address_length = address_length;
 	strcpy(cs->socket_address, address);
 	
 	return cs;
 }
 void Subscriber_destroy(Subscriber* sub){
-	free(sub->socket_address);
-	free(sub);
+	if(Pool_owns(subscriberPool, sub)){
+		Pool_put(subscriberPool, sub);
+	} else {
+		free(sub->socket_address);
+		free(sub);
+	}
 }
 
 SubscriberList* SubscriberList_new(int max_num_subs){
-	SubscriberList* subs = malloc(sizeof(SubscriberList));
+	SubscriberList* subs = mem_alloc(sizeof(SubscriberList));
 	subs->max_num_subs = max_num_subs;
 	subs->num_subs = 0;
 
@@ -62,7 +95,7 @@ SubscriberList* SubscriberList_new(int max_num_subs){
 void SubscriberList_destroy(SubscriberList* sl){
 	int i = 0;
 	for(i = 0 ; i < sl->num_subs ; i++){
-		free(&sl->subscribers[i]);
+		Subscriber_destroy(sl->subscribers[i]);
 	}
 	free(sl);
 }
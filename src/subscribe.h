@@ -41,10 +41,14 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <stdint.h>
 
 /* Hard-coded maximum (allocated) size of subscriber-list. */
 #define MAX_NUM_SUBSCRIBERS 25
 
+/* Longest address (with null-terminator) a pooled Subscriber has room for, see Subscriber_initPool() */
+#define SUBSCRIBER_POOL_ADDRESS_LENGTH sizeof(((struct sockaddr_un*)0)->sun_path)
+
 /* Wrapper object for a subscriber socket address */
 typedef struct Subscriber {
 	char* 		socket_address;	/* Path to the subscriber's unix domain listening socket */
@@ -66,10 +70,29 @@ typedef struct SubscriberList {
  * 	Returns:
  * 		Subscriber*		- Pointer to new Subscriber
  *
- * 	Subscriber is allocated on heap, use Subscriber_destroy to free memory properly
+ * 	Subscriber is taken from the pool if there is one (see Subscriber_initPool()),
+ * 	else allocated on heap. Use Subscriber_destroy to free memory properly
  */
 Subscriber* Subscriber_new(char* address, unsigned int address_length);
 
+/*
+ * Keep Subscriber objects in a pool
+ * 	Arguments:
+ * 		count	- Number of Subscribers in the pool
+ * 	Returns:
+ * 		void
+ *
+ * 	Subscriber_new() takes Subscribers with addresses of up to SUBSCRIBER_POOL_ADDRESS_LENGTH
+ * 	bytes from the pool while there are any left, and Subscriber_destroy() gives them back.
+ * 	Free the pool with Subscriber_freePool().
+ */
+void Subscriber_initPool(uint32_t count);
+
+/*
+ * Free the pool made by Subscriber_initPool(). No pooled Subscriber may be in use
+ */
+void Subscriber_freePool();
+
 /*
  * Destroy/free a Subscriber
  * 	Arguments:
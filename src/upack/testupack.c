@@ -31,9 +31,199 @@
 #include <stdio.h>
 #include <assert.h>
 #include <limits.h>
+#include <time.h>
 
 #include "upack.h"
 
+#define BENCH_VALUES	4096	/* Values (and records) per round */
+#define BENCH_ROUNDS	500
+#define RECORD_SIZE		38		/* Node record: id, lat, lon, range, ip, port, radac ip, radac port, time */
+
+/* enc754() and dec754() as they were before the bit-cast, for comparison */
+static uint64_t enc754_loop(double f){
+	double fnorm;
+	int32_t shift;
+	int64_t sign, exp, significand;
+	uint32_t significandbits = 52;
+
+	if (f == 0.0) return 0;
+
+	if (f < 0) { sign = 1; fnorm = -f; }
+	else { sign = 0; fnorm = f; }
+
+	shift = 0;
+	while(fnorm >= 2.0) { fnorm /= 2.0; shift++; }
+	while(fnorm < 1.0) { fnorm *= 2.0; shift--; }
+	fnorm = fnorm - 1.0;
+
+	significand = fnorm * ((1LL<<significandbits) + 0.5f);
+	exp = shift + ((1<<(10)) - 1);
+
+	return (sign<<(63)) | (exp<<(52)) | significand;
+}
+
+static double dec754_loop(uint64_t i){
+	double result;
+	int64_t shift;
+	uint32_t bias;
+	uint32_t significandbits = 52;
+
+	if (i == 0) return 0.0;
+
+	result = (i&((1LL<<significandbits)-1));
+	result /= (1LL<<significandbits);
+	result += 1.0f;
+
+	bias = (1<<(11-1)) - 1;
+	shift = ((i>>significandbits)&((1LL<<11)-1)) - bias;
+	while(shift > 0) { result *= 2.0; shift--; }
+	while(shift < 0) { result /= 2.0; shift++; }
+
+	result *= (i>>(63))&1? -1.0: 1.0;
+
+	return result;
+}
+
+/* Wall-clock time in seconds */
+static double bench_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Random 64-bit pattern */
+static uint64_t bench_random64(){
+	return ((uint64_t)rand() << 48) ^ ((uint64_t)rand() << 24) ^ (uint64_t)rand();
+}
+
+/* A record the way NodeCollection_pack() wrote it, field by field with the old encoding */
+static void record_pack_old(unsigned char* buf, uint32_t id, double lat, double lon){
+	pack32(buf, id);
+	pack64(buf + 4, enc754_loop(lat));
+	pack64(buf + 12, enc754_loop(lon));
+	pack16(buf + 20, 10);
+	pack32(buf + 22, 0x7f000001);
+	pack16(buf + 26, 2001);
+	pack32(buf + 28, 0x7f000001);
+	pack16(buf + 32, 45452);
+	pack32(buf + 34, id);
+}
+
+/* The same record with the inline functions, as Node_pack() does */
+static inline void record_pack_new(unsigned char* buf, uint32_t id, double lat, double lon){
+	upack_put32(buf, id);
+	upack_putdouble(buf + 4, lat);
+	upack_putdouble(buf + 12, lon);
+	upack_put16(buf + 20, 10);
+	upack_put32(buf + 22, 0x7f000001);
+	upack_put16(buf + 26, 2001);
+	upack_put32(buf + 28, 0x7f000001);
+	upack_put16(buf + 32, 45452);
+	upack_put32(buf + 34, id);
+}
+
+/* Checks that the new encoding is bit-identical to the old, then compares their throughput */
+static void bench(){
+	static double values[BENCH_VALUES], lats[BENCH_VALUES], lons[BENCH_VALUES];
+	static uint64_t encoded[BENCH_VALUES];
+	static unsigned char buf_old[BENCH_VALUES * RECORD_SIZE], buf_new[BENCH_VALUES * RECORD_SIZE];
+	int i, r;
+	double t0, t_old, t_new, sum = 0;
+
+	/* Normal doubles of every exponent, and positions as they are sent */
+	for(i = 0 ; i < BENCH_VALUES ; i++){
+		uint64_t bits = bench_random64();
+		uint64_t exp = 1 + bits % 2046;
+		bits = (bits & 0x800fffffffffffffULL) | (exp << 52);
+		memcpy(&values[i], &bits, 8);
+		lats[i] = -90.0 + 180.0 * rand() / RAND_MAX;
+		lons[i] = -180.0 + 360.0 * rand() / RAND_MAX;
+	}
+
+	for(i = 0 ; i < BENCH_VALUES ; i++){
+		assert(enc754(values[i]) == enc754_loop(values[i]));
+		assert(enc754(lats[i]) == enc754_loop(lats[i]));
+		assert(dec754(enc754_loop(values[i])) == dec754_loop(enc754_loop(values[i])));
+		assert(dec754(enc754(lons[i])) == lons[i]);
+		record_pack_old(buf_old + i * RECORD_SIZE, i, lats[i], lons[i]);
+		record_pack_new(buf_new + i * RECORD_SIZE, i, lats[i], lons[i]);
+	}
+	assert(enc754(-0.0) == enc754_loop(-0.0));
+	assert(memcmp(buf_old, buf_new, sizeof(buf_old)) == 0);
+	printf("<new encoding bit-identical to the old>\n");
+
+	/* Encoding positions, one double at a time */
+	t0 = bench_now();
+	for(r = 0 ; r < BENCH_ROUNDS ; r++)
+		for(i = 0 ; i < BENCH_VALUES ; i++)
+			encoded[i] += enc754_loop(lats[i]);
+	t_old = bench_now() - t0;
+	t0 = bench_now();
+	for(r = 0 ; r < BENCH_ROUNDS ; r++)
+		for(i = 0 ; i < BENCH_VALUES ; i++)
+			encoded[i] += enc754(lats[i]);
+	t_new = bench_now() - t0;
+	printf("enc754: loop %.1f ns, bit-cast %.1f ns per double\n",
+			t_old * 1e9 / BENCH_ROUNDS / BENCH_VALUES, t_new * 1e9 / BENCH_ROUNDS / BENCH_VALUES);
+
+	/* Decoding */
+	for(i = 0 ; i < BENCH_VALUES ; i++)
+		encoded[i] = enc754(lats[i]);
+	t0 = bench_now();
+	for(r = 0 ; r < BENCH_ROUNDS ; r++)
+		for(i = 0 ; i < BENCH_VALUES ; i++)
+			sum += dec754_loop(encoded[i]);
+	t_old = bench_now() - t0;
+	t0 = bench_now();
+	for(r = 0 ; r < BENCH_ROUNDS ; r++)
+		for(i = 0 ; i < BENCH_VALUES ; i++)
+			sum += dec754(encoded[i]);
+	t_new = bench_now() - t0;
+	printf("dec754: loop %.1f ns, bit-cast %.1f ns per double\n",
+			t_old * 1e9 / BENCH_ROUNDS / BENCH_VALUES, t_new * 1e9 / BENCH_ROUNDS / BENCH_VALUES);
+
+	/* Whole records */
+	t0 = bench_now();
+	for(r = 0 ; r < BENCH_ROUNDS ; r++)
+		for(i = 0 ; i < BENCH_VALUES ; i++)
+			record_pack_old(buf_old + i * RECORD_SIZE, i + r, lats[i], lons[i]);
+	t_old = bench_now() - t0;
+	t0 = bench_now();
+	for(r = 0 ; r < BENCH_ROUNDS ; r++)
+		for(i = 0 ; i < BENCH_VALUES ; i++)
+			record_pack_new(buf_new + i * RECORD_SIZE, i + r, lats[i], lons[i]);
+	t_new = bench_now() - t0;
+	printf("Node record pack: field by field %.1f ns, inline %.1f ns per record (%.0f MB/s)\n",
+			t_old * 1e9 / BENCH_ROUNDS / BENCH_VALUES, t_new * 1e9 / BENCH_ROUNDS / BENCH_VALUES,
+			(double)BENCH_ROUNDS * BENCH_VALUES * RECORD_SIZE / t_new / 1e6);
+
+	t0 = bench_now();
+	for(r = 0 ; r < BENCH_ROUNDS ; r++)
+		for(i = 0 ; i < BENCH_VALUES ; i++){
+			unsigned char* b = buf_old + i * RECORD_SIZE;
+			sum += unpacku32(b) + dec754_loop(unpacku64(b + 4)) + dec754_loop(unpacku64(b + 12)) +
+					unpacku16(b + 20) + unpacku32(b + 22) + unpacku16(b + 26) +
+					unpacku32(b + 28) + unpacku16(b + 32) + unpacku32(b + 34);
+		}
+	t_old = bench_now() - t0;
+	t0 = bench_now();
+	for(r = 0 ; r < BENCH_ROUNDS ; r++)
+		for(i = 0 ; i < BENCH_VALUES ; i++){
+			unsigned char* b = buf_new + i * RECORD_SIZE;
+			sum += upack_get32(b) + upack_getdouble(b + 4) + upack_getdouble(b + 12) +
+					upack_get16(b + 20) + upack_get32(b + 22) + upack_get16(b + 26) +
+					upack_get32(b + 28) + upack_get16(b + 32) + upack_get32(b + 34);
+		}
+	t_new = bench_now() - t0;
+	printf("Node record unpack: field by field %.1f ns, inline %.1f ns per record (%.0f MB/s)\n",
+			t_old * 1e9 / BENCH_ROUNDS / BENCH_VALUES, t_new * 1e9 / BENCH_ROUNDS / BENCH_VALUES,
+			(double)BENCH_ROUNDS * BENCH_VALUES * RECORD_SIZE / t_new / 1e6);
+
+	/* Keep the results alive */
+	if(sum == 0 && encoded[0] == 0)
+		printf("\n");
+}
+
 int main (void){
 
     printf("Running upack tests...\n");
@@ -143,5 +333,45 @@ int main (void){
 
     printf("<double encode/decode/pack successful>\n");
 
+    // Test the inline functions against the ones above
+
+    unsigned char f_p[8];
+
+    upack_put16(f_p, u0);
+    assert(unpacku16(f_p) == u0 && upack_get16(f_p) == u0);
+    upack_put32(f_p, u1);
+    assert(unpacku32(f_p) == u1 && upack_get32(f_p) == u1);
+    upack_put64(f_p, u3);
+    assert(unpacku64(f_p) == u3 && upack_get64(f_p) == u3);
+    upack_putdouble(f_p, d2);
+    assert(unpackdouble(f_p) == d2 && upack_getdouble(f_p) == d2);
+
+    printf("<inline pack/unpack OK>\n");
+
+    // Varints
+
+    unsigned char v_p[UPACK_VARINT_MAX];
+    uint32_t v_in[] = {0, 1, 127, 128, 16383, 16384, UINT_MAX};
+    int v_len[] = {1, 1, 1, 2, 2, 3, 5};
+    uint32_t v_out;
+
+    for(int v = 0 ; v < 7 ; v++){
+        assert(upack_putvarint(v_p, v_in[v]) == v_len[v]);
+        assert(upack_getvarint(v_p, v_len[v], &v_out) == v_len[v] && v_out == v_in[v]);
+        assert(upack_getvarint(v_p, v_len[v] - 1, &v_out) == 0);
+    }
+    memset(v_p, 0x80, UPACK_VARINT_MAX);
+    assert(upack_getvarint(v_p, UPACK_VARINT_MAX, &v_out) == 0);
+
+    int32_t z_in[] = {0, -1, 1, -64, 63, INT_MIN, INT_MAX};
+    uint32_t z_out[] = {0, 1, 2, 127, 126, UINT_MAX, UINT_MAX - 1};
+    for(int z = 0 ; z < 7 ; z++){
+        assert(upack_zigzag(z_in[z]) == z_out[z] && upack_unzigzag(z_out[z]) == z_in[z]);
+    }
+
+    printf("<varint OK>\n");
+
+    bench();
+
     return 0;
 }
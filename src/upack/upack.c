@@ -40,61 +40,20 @@
 
 /*
 ** enc754() -- pack a floating point number into IEEE-754 format
+**
+** Doubles are IEEE-754 on every supported target, so this is just their bits.
+** Zero has one encoding, -0.0 is sent as 0.0.
 */ 
 uint64_t enc754(double f){
-	double fnorm;
-	int32_t shift;
-	int64_t sign, exp, significand;
-	uint32_t significandbits = 52; //64 - 11 - 1 && -1 for sign bit
-
 	if (f == 0.0) return 0; // get this special case out of the way
-
-	// check sign and begin normalization
-	if (f < 0) { sign = 1; fnorm = -f; }
-	else { sign = 0; fnorm = f; }
-
-	// get the normalized form of f and track the exponent
-	shift = 0;
-	while(fnorm >= 2.0) { fnorm /= 2.0; shift++; }
-	while(fnorm < 1.0) { fnorm *= 2.0; shift--; }
-	fnorm = fnorm - 1.0;
-
-	// calculate the binary form (non-float) of the significand data
-	significand = fnorm * ((1LL<<significandbits) + 0.5f);
-
-	// get the biased exponent
-	exp = shift + ((1<<(10)) - 1); // shift + bias
-
-	// return the final answer
-	return (sign<<(63)) | (exp<<(52)) | significand;
+	return upack_bits754(f);
 }
 
 /*
 ** dec754() -- decode a floating point number from IEEE-754 format
 */ 
 double dec754(uint64_t i){
-	double result;
-	int64_t shift;
-	uint32_t bias;
-	uint32_t significandbits = 52; //64 - 11 - 1 && -1 for sign bit
-
-	if (i == 0) return 0.0;
-
-	// pull the significand
-	result = (i&((1LL<<significandbits)-1)); // mask
-	result /= (1LL<<significandbits); // convert back to float
-	result += 1.0f; // add the one back on
-
-	// deal with the exponent
-	bias = (1<<(11-1)) - 1;
-	shift = ((i>>significandbits)&((1LL<<11)-1)) - bias;
-	while(shift > 0) { result *= 2.0; shift--; }
-	while(shift < 0) { result /= 2.0; shift++; }
-
-	// sign it
-	result *= (i>>(63))&1? -1.0: 1.0;
-
-	return result;
+	return upack_double754(i);
 }
 
 
@@ -31,8 +31,10 @@
 #define INCLUDE_UPACK_H_ 
 
 #include <stdint.h>
+#include <string.h>
 
-/* Floating point encode/decode - using 64 bits for all float representations */
+/* Floating point encode/decode - using 64 bits for all float representations.
+ * The bits of the double as it is in memory, except that -0.0 is encoded as 0 */
 
 uint64_t enc754(double f);
 double dec754(uint64_t i);
@@ -58,4 +60,134 @@ uint64_t unpacku64(unsigned char* buf);
 #define packdouble(buf, f) ( pack64(buf, enc754(f)) )
 #define unpackdouble(buf) ( dec754(unpacku64(buf)) )
 
+/* Inline fast path, for packing whole records in one go (see Node_packArray() in serialize.h).
+ * Same encodings as the functions above: big-endian integers, and doubles as enc754().
+ * Loads and stores go through memcpy(), so buf does not need to be aligned, and are byte
+ * swapped with the compiler intrinsics on little-endian targets. */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define UPACK_BE16(i) __builtin_bswap16(i)
+#define UPACK_BE32(i) __builtin_bswap32(i)
+#define UPACK_BE64(i) __builtin_bswap64(i)
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define UPACK_BE16(i) (i)
+#define UPACK_BE32(i) (i)
+#define UPACK_BE64(i) (i)
+#else
+#define UPACK_PORTABLE	/* Unknown byte order, use the shifts of pack16() and friends */
+#endif
+
+#ifdef UPACK_PORTABLE
+
+static inline void upack_put16(unsigned char* buf, uint16_t i){ pack16(buf, i); }
+static inline void upack_put32(unsigned char* buf, uint32_t i){ pack32(buf, i); }
+static inline void upack_put64(unsigned char* buf, uint64_t i){ pack64(buf, i); }
+static inline uint16_t upack_get16(const unsigned char* buf){ return unpacku16((unsigned char*)buf); }
+static inline uint32_t upack_get32(const unsigned char* buf){ return unpacku32((unsigned char*)buf); }
+static inline uint64_t upack_get64(const unsigned char* buf){ return unpacku64((unsigned char*)buf); }
+
+#else
+
+static inline void upack_put16(unsigned char* buf, uint16_t i){
+	i = UPACK_BE16(i);
+	memcpy(buf, &i, 2);
+}
+
+static inline void upack_put32(unsigned char* buf, uint32_t i){
+	i = UPACK_BE32(i);
+	memcpy(buf, &i, 4);
+}
+
+static inline void upack_put64(unsigned char* buf, uint64_t i){
+	i = UPACK_BE64(i);
+	memcpy(buf, &i, 8);
+}
+
+static inline uint16_t upack_get16(const unsigned char* buf){
+	uint16_t i;
+	memcpy(&i, buf, 2);
+	return UPACK_BE16(i);
+}
+
+static inline uint32_t upack_get32(const unsigned char* buf){
+	uint32_t i;
+	memcpy(&i, buf, 4);
+	return UPACK_BE32(i);
+}
+
+static inline uint64_t upack_get64(const unsigned char* buf){
+	uint64_t i;
+	memcpy(&i, buf, 8);
+	return UPACK_BE64(i);
+}
+
+#endif /* UPACK_PORTABLE */
+
+/* IEEE-754 bits of f. Some old ARM ABIs store the two 32-bit words of a double the other way round */
+static inline uint64_t upack_bits754(double f){
+	uint64_t i;
+	memcpy(&i, &f, 8);
+#if defined(__FLOAT_WORD_ORDER__) && defined(__BYTE_ORDER__) && __FLOAT_WORD_ORDER__ != __BYTE_ORDER__
+	i = (i << 32) | (i >> 32);
+#endif
+	return i;
+}
+
+static inline double upack_double754(uint64_t i){
+	double f;
+#if defined(__FLOAT_WORD_ORDER__) && defined(__BYTE_ORDER__) && __FLOAT_WORD_ORDER__ != __BYTE_ORDER__
+	i = (i << 32) | (i >> 32);
+#endif
+	memcpy(&f, &i, 8);
+	return f;
+}
+
+static inline void upack_putdouble(unsigned char* buf, double f){
+	upack_put64(buf, f == 0.0 ? 0 : upack_bits754(f));
+}
+
+static inline double upack_getdouble(const unsigned char* buf){
+	return upack_double754(upack_get64(buf));
+}
+
+/* Unsigned variable-length integers (LEB128): 7 bits per byte, lowest first, with the high bit
+ * set on every byte but the last. Values below 128 take one byte, 32 bits at most UPACK_VARINT_MAX */
+
+#define UPACK_VARINT_MAX 5
+
+/* Returns the number of bytes written */
+static inline int upack_putvarint(unsigned char* buf, uint32_t i){
+	int n = 0;
+	while(i >= 0x80){
+		buf[n++] = (unsigned char)(i | 0x80);
+		i >>= 7;
+	}
+	buf[n++] = (unsigned char)i;
+	return n;
+}
+
+/* Returns the number of bytes read, 0 if the varint runs past size bytes or is too long */
+static inline int upack_getvarint(const unsigned char* buf, int size, uint32_t* i){
+	uint32_t v = 0;
+	int n;
+	for(n = 0 ; n < size && n < UPACK_VARINT_MAX ; n++){
+		v |= (uint32_t)(buf[n] & 0x7f) << (7 * n);
+		if(!(buf[n] & 0x80)){
+			*i = v;
+			return n + 1;
+		}
+	}
+	return 0;
+}
+
+/* Signed integers for varints (zigzag): small magnitudes of either sign map to small values */
+
+static inline uint32_t upack_zigzag(int32_t i){
+	return ((uint32_t)i << 1) ^ (uint32_t)(i >> 31);
+}
+
+static inline int32_t upack_unzigzag(uint32_t i){
+	return (int32_t)(i >> 1) ^ -(int32_t)(i & 1);
+}
+
 #endif
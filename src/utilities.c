@@ -93,13 +93,158 @@ void log_error(errType priority, int err, char* errMsg, ...){
 	va_end(args);		/* Cleanup variable argument stuff */
 }
 
+/* Heap allocations so far. Updated atomically, as WorkerPool threads may allocate too */
+static unsigned long mem_count = 0;
+
+void* mem_alloc(size_t size){
+	__atomic_fetch_add(&mem_count, 1, __ATOMIC_RELAXED);
+	return malloc(size);
+}
+
+void* mem_calloc(size_t count, size_t size){
+	__atomic_fetch_add(&mem_count, 1, __ATOMIC_RELAXED);
+	return calloc(count, size);
+}
+
+/* Arena used by mem_new(). Per thread, so WorkerPool threads always use the heap */
+static __thread Arena* mem_arena = NULL;
+
+/* Every Arena allocation is preceded by its size, to be able to mem_realloc() it */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void* mem_realloc(void* ptr, size_t size){
+	if(ptr && Arena_owns(mem_arena, ptr)){
+		size_t old = *(size_t*)((unsigned char*)ptr - ARENA_ALIGN);
+		void* moved = mem_alloc(size);
+		if(moved){
+			memcpy(moved, ptr, old < size ? old : size);
+		}
+		return moved;
+	}
+	__atomic_fetch_add(&mem_count, 1, __ATOMIC_RELAXED);
+	return realloc(ptr, size);
+}
+
+unsigned long mem_allocations(){
+	return __atomic_load_n(&mem_count, __ATOMIC_RELAXED);
+}
+
+Arena* Arena_new(size_t size){
+	Arena* a = mem_alloc(sizeof(Arena));
+	a->size = ARENA_ROUND(size);
+	a->base = mem_alloc(a->size);
+	a->used = 0;
+	a->wanted = 0;
+	a->allocations = 0;
+	return a;
+}
+
+void* Arena_alloc(Arena* a, size_t size){
+	size_t need = ARENA_ALIGN + ARENA_ROUND(size);
+	a->wanted += need;
+	if(a->used + need > a->size){
+		return NULL;
+	}
+	unsigned char* p = a->base + a->used + ARENA_ALIGN;
+	*(size_t*)(p - ARENA_ALIGN) = size;
+	a->used += need;
+	a->allocations++;
+	return p;
+}
+
+void Arena_reset(Arena* a){
+	if(a->wanted > a->size){
+		/* Make room for all of it next time, with some to spare */
+		free(a->base);
+		a->size = ARENA_ROUND(a->wanted + a->wanted / 4);
+		a->base = mem_alloc(a->size);
+		log_event(LOG_DEBUG, "Event arena grown to %lu bytes", (unsigned long)a->size);
+	}
+	a->used = 0;
+	a->wanted = 0;
+}
+
+int Arena_owns(const Arena* a, const void* ptr){
+	return a && (const unsigned char*)ptr >= a->base && (const unsigned char*)ptr < a->base + a->size;
+}
+
+void Arena_destroy(Arena* a){
+	if(a){
+		if(mem_arena == a){
+			mem_arena = NULL;
+		}
+		free(a->base);
+		free(a);
+	}
+}
+
+void mem_setArena(Arena* a){
+	mem_arena = a;
+}
+
+void* mem_new(size_t size){
+	void* p = mem_arena ? Arena_alloc(mem_arena, size) : NULL;
+	return p ? p : mem_alloc(size);
+}
+
+void mem_free(void* ptr){
+	if(!Arena_owns(mem_arena, ptr)){
+		free(ptr);
+	}
+}
+
+Pool* Pool_new(size_t objectSize, uint32_t count){
+	Pool* p = mem_alloc(sizeof(Pool));
+	/* Room for the free list link, and aligned like malloc() */
+	if(objectSize < sizeof(void*)){
+		objectSize = sizeof(void*);
+	}
+	p->objectSize = ARENA_ROUND(objectSize);
+	p->count = count;
+	p->base = mem_alloc(p->objectSize * count);
+	p->freeList = NULL;
+	uint32_t i;
+	for(i = count ; i > 0 ; i--){
+		void* obj = p->base + (i - 1) * p->objectSize;
+		*(void**)obj = p->freeList;
+		p->freeList = obj;
+	}
+	return p;
+}
+
+void* Pool_get(Pool* p){
+	if(!p || !p->freeList){
+		return NULL;
+	}
+	void* obj = p->freeList;
+	p->freeList = *(void**)obj;
+	return obj;
+}
+
+void Pool_put(Pool* p, void* obj){
+	*(void**)obj = p->freeList;
+	p->freeList = obj;
+}
+
+int Pool_owns(const Pool* p, const void* obj){
+	return p && (const unsigned char*)obj >= p->base && (const unsigned char*)obj < p->base + p->objectSize * p->count;
+}
+
+void Pool_destroy(Pool* p){
+	if(p){
+		free(p->base);
+		free(p);
+	}
+}
+
 /* A pretty simple and unrealiable way to get the ip of the host.
  * Will get the last supplied address, which may or may not be the
  * actual Internet-address of the host. Only used as fallback. */
 int getHostIPAddress(){
 	struct ifaddrs* ifAddrStruct = NULL;
 	struct ifaddrs* ifa = NULL;
-	uint32_t* networkByteIP_ptr = malloc(INET_ADDRSTRLEN);
+	uint32_t* networkByteIP_ptr = mem_alloc(INET_ADDRSTRLEN);
 	uint32_t ip;
 
 	getifaddrs(&ifAddrStruct);
@@ -157,9 +302,120 @@ double geo_distance_meters(double th1, double ph1, double th2, double ph2){
 	return asin(sqrt(dx * dx + dy * dy + dz * dz) / 2) * 2 * R;
 }
 
+void geo_unit_vector(double lat, double lon, double v[3]){
+	lat *= TO_RAD, lon *= TO_RAD;
+
+	v[0] = cos(lat) * cos(lon);
+	v[1] = cos(lat) * sin(lon);
+	v[2] = sin(lat);
+}
+
+/* Cosine of latitude in Q30, at every 2^18 micro-degrees (about 0.26 degrees) from 0 to 90
+ * degrees. Interpolated linearly, which is within 3e-6 of cos(). Filled when the first
+ * position is converted, i.e. before any worker thread reads it. */
+#define GEO_FIXED_COS_SHIFT 18
+#define GEO_FIXED_COS_ENTRIES ((90 * GEO_FIXED_SCALE >> GEO_FIXED_COS_SHIFT) + 2)
+static int32_t geo_fixed_cos_table[GEO_FIXED_COS_ENTRIES];
+static int geo_fixed_cos_ready = 0;
+
+static void geo_fixed_cos_init(){
+	int i;
+	for(i = 0 ; i < GEO_FIXED_COS_ENTRIES ; i++){
+		double deg = (double)((int64_t)i << GEO_FIXED_COS_SHIFT) / GEO_FIXED_SCALE;
+		geo_fixed_cos_table[i] = deg < 90 ? (int32_t)lround(cos(deg * TO_RAD) * (1 << 30)) : 0;
+	}
+	geo_fixed_cos_ready = 1;
+}
+
+static int64_t geo_fixed_cos(int32_t lat){
+	if(!geo_fixed_cos_ready){
+		geo_fixed_cos_init();
+	}
+	uint32_t a = lat < 0 ? -lat : lat;
+	uint32_t i = a >> GEO_FIXED_COS_SHIFT;
+	int64_t frac = a & ((1 << GEO_FIXED_COS_SHIFT) - 1);
+	int64_t c0 = geo_fixed_cos_table[i], c1 = geo_fixed_cos_table[i + 1];
+	return c0 - (((c0 - c1) * frac) >> GEO_FIXED_COS_SHIFT);
+}
+
+int32_t geo_fixed_degrees(double deg, int limit){
+	if(!geo_fixed_cos_ready){
+		geo_fixed_cos_init();
+	}
+	if(deg > limit) deg = limit;
+	if(deg < -limit) deg = -limit;
+	return (int32_t)lround(deg * GEO_FIXED_SCALE);
+}
+
+uint64_t geo_fixed_distance_sqrd(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2){
+	int64_t dlat = (int64_t)lat2 - lat1;
+	int64_t dlon = (int64_t)lon2 - lon1;
+	if(dlon < 0) dlon = -dlon;
+	if(dlon > 180 * GEO_FIXED_SCALE) dlon = 360 * GEO_FIXED_SCALE - dlon;
+	int64_t dx = (dlon * geo_fixed_cos((int32_t)(((int64_t)lat1 + lat2) / 2))) >> 30;
+	return (uint64_t)(dlat * dlat) + (uint64_t)(dx * dx);
+}
+
 uint32_t generateUniqueID(){
 	
-	return (uint32_t)rand();
+	return (uint32_t)(random_next() >> 32);
+}
+
+/* State of the xoshiro256** generator, all zero until seeded */
+static uint64_t random_state[4];
+
+/* splitmix64, used to spread a 64-bit seed over the generator state */
+static uint64_t splitmix64(uint64_t* x){
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+void random_seed(uint64_t seed){
+	if(seed == 0){
+		if(getrandom(&seed, sizeof(seed), 0) != sizeof(seed)){
+			/* No getrandom() - mix what we have */
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			seed = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ (uint64_t)ts.tv_nsec;
+		}
+	}
+	int i;
+	for(i = 0 ; i < 4 ; i++){
+		random_state[i] = splitmix64(&seed);
+	}
+}
+
+static inline uint64_t rotl(const uint64_t x, int k){
+	return (x << k) | (x >> (64 - k));
+}
+
+uint64_t random_next(){
+	uint64_t* s = random_state;
+	if((s[0] | s[1] | s[2] | s[3]) == 0){
+		random_seed(0);
+	}
+	const uint64_t result = rotl(s[1] * 5, 7) * 9;
+	const uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+
+	return result;
+}
+
+/* Multiply-shift instead of modulo; the bias is below 2^-32 */
+uint32_t random_below(uint32_t n){
+	return (uint32_t)(((random_next() >> 32) * (uint64_t)n) >> 32);
+}
+
+double random_double(){
+	return (random_next() >> 11) * 0x1.0p-53;
 }
 
 /* Helper function to convert uint64_t to network byte order. 
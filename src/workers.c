@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2012-2014, Magnus Skjegstad / Forsvarets Forskningsinstitutt (FFI)
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ * this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ * this list of conditions and the following disclaimer in the documentation 
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * workers.c
+ *
+ *	Implementation of functions defined in workers.h
+ *	Refer to header file for documentation.
+ */
+
+#include <stdlib.h>
+
+#include "workers.h"
+#include "utilities.h"
+
+/* Takes and runs parts of the current task until there are none left. Called with the lock held */
+static void WorkerPool_work(WorkerPool* pool){
+	while(pool->nextPart < pool->parts){
+		int part = pool->nextPart++;
+		pthread_mutex_unlock(&pool->lock);
+		pool->task(pool->arg, part, pool->parts);
+		pthread_mutex_lock(&pool->lock);
+		if(--pool->running == 0){
+			pthread_cond_signal(&pool->done);
+		}
+	}
+}
+
+static void* WorkerPool_thread(void* p){
+	WorkerPool* pool = p;
+	uint32_t seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	while(!pool->stop){
+		if(pool->generation != seen){
+			seen = pool->generation;
+			WorkerPool_work(pool);
+		} else {
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+WorkerPool* WorkerPool_new(int numThreads){
+	WorkerPool* pool = mem_calloc(1, sizeof(WorkerPool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->threads = mem_calloc(numThreads > 1 ? numThreads - 1 : 1, sizeof(pthread_t));
+
+	pool->numThreads = 1;
+	int i;
+	for(i = 1 ; i < numThreads ; i++){
+		if(pthread_create(&pool->threads[i - 1], NULL, WorkerPool_thread, pool) != 0){
+			break;	/* Make do with the threads we got */
+		}
+		pool->numThreads++;
+	}
+	return pool;
+}
+
+void WorkerPool_destroy(WorkerPool* pool){
+	if(pool){
+		pthread_mutex_lock(&pool->lock);
+		pool->stop = 1;
+		pthread_cond_broadcast(&pool->start);
+		pthread_mutex_unlock(&pool->lock);
+
+		int i;
+		for(i = 0 ; i < pool->numThreads - 1 ; i++){
+			pthread_join(pool->threads[i], NULL);
+		}
+		pthread_mutex_destroy(&pool->lock);
+		pthread_cond_destroy(&pool->start);
+		pthread_cond_destroy(&pool->done);
+		free(pool->threads);
+		free(pool);
+	}
+}
+
+void WorkerPool_run(WorkerPool* pool, WorkerTask task, void* arg, int parts){
+	int i;
+	if(!pool || pool->numThreads < 2 || parts < 2){
+		for(i = 0 ; i < parts ; i++){
+			task(arg, i, parts);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->task = task;
+	pool->arg = arg;
+	pool->parts = parts;
+	pool->nextPart = 0;
+	pool->running = parts;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+
+	WorkerPool_work(pool);
+	while(pool->running > 0){
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
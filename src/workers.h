@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2012-2014, Magnus Skjegstad / Forsvarets Forskningsinstitutt (FFI)
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ * this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice, 
+ * this list of conditions and the following disclaimer in the documentation 
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * workers.h
+ *
+ * A small pool of worker threads for splitting bulk work over NodeCollections
+ * (utility calculation, sorting) into parts that run in parallel.
+ */
+
+#ifndef INCLUDE_WORKERS_H_
+#define INCLUDE_WORKERS_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* A task run by the pool: called once for each part in [0, parts), from any thread */
+typedef void (*WorkerTask)(void* arg, int part, int parts);
+
+typedef struct WorkerPool {
+	int				numThreads;		/* Threads working on a task, including the calling thread */
+	pthread_t*		threads;		/* The numThreads - 1 extra threads */
+	pthread_mutex_t	lock;
+	pthread_cond_t	start;			/* Signalled when a task is posted, or on shutdown */
+	pthread_cond_t	done;			/* Signalled when the last part of a task is finished */
+	WorkerTask		task;			/* Current task, valid while running > 0 */
+	void*			arg;
+	int				parts;
+	int				nextPart;		/* Next part to hand out */
+	int				running;		/* Parts not yet finished */
+	uint32_t		generation;		/* Incremented for each task */
+	int				stop;
+} WorkerPool;
+
+/*
+ * Create a WorkerPool
+ * 	Arguments:
+ * 		numThreads	- Number of threads to work on a task, including the thread calling
+ * 					  WorkerPool_run(). 1 or less gives a pool that runs everything in the caller
+ * 	Returns:
+ * 		Pointer to WorkerPool, to be freed by WorkerPool_destroy()
+ */
+WorkerPool* WorkerPool_new(int numThreads);
+
+/*
+ * Stop the threads of a WorkerPool and free it
+ * 	Arguments:
+ * 		pool	- Pointer to WorkerPool, may be NULL
+ */
+void WorkerPool_destroy(WorkerPool* pool);
+
+/*
+ * Run a task in parts on the pool, and wait for all parts to finish
+ * 	Arguments:
+ * 		pool	- Pointer to WorkerPool, or NULL to run all parts in the calling thread
+ * 		task	- Function to call for each part
+ * 		arg		- Argument passed to task
+ * 		parts	- Number of parts
+ * 	Returns:
+ * 		void
+ *
+ * 	The calling thread works on parts too. Only one task runs on a pool at a time, and
+ * 	it must only be called from one thread (the main loop).
+ */
+void WorkerPool_run(WorkerPool* pool, WorkerTask task, void* arg, int parts);
+
+#endif /* INCLUDE_WORKERS_H_ */